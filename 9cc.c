@@ -7,47 +7,97 @@ static char *read_file(char *path) {
     if (!fp)
         error("cannot open %s: %s", path, strerror(errno));
 
-    int filemax = 10 * 1024 * 1024;
-    char *buf = malloc(filemax);
-    int size = fread(buf, 1, filemax -2, fp);
-
-    if (!feof(fp))
-        error("%s: file too large");
+    char *buf;
+    size_t size;
+    FILE *out = open_memstream(&buf, &size);
+    char tmp[4096];
+    for (;;) {
+        int n = fread(tmp, 1, sizeof(tmp), fp);
+        if (n == 0)
+            break;
+        fwrite(tmp, 1, n, out);
+    }
+    fclose(fp);
 
     // Make sure that the string ends with "\n\0".
+    fflush(out);
     if (size == 0 || buf[size - 1] != '\n')
-        buf[size++] = '\n';
-    buf[size] = '\0';
+        fputc('\n', out);
+
+    // トークナイザは 16 バイト単位で読むので、終端の後ろも埋めておく
+    fwrite((char[16]){0}, 1, 16, out);
+    fclose(out);
     return buf;
+}
 
+static Context ctx;
+static bool opt_run;
+static char *server_path;
+static char **args; // サーバに渡すオプション
+static int num_args;
 
+static void parse_args(int argc, char **argv) {
+    char *path = NULL;
+    args = calloc(argc, sizeof(char *));
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--run")) {
+            opt_run = true;
+            continue;
+        }
+        if (!strncmp(argv[i], "--server=", 9)) {
+            server_path = argv[i] + 9;
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            char *msg = parse_option(&ctx, argv[i]);
+            if (msg)
+                error("%s", msg);
+            args[num_args++] = argv[i];
+            continue;
+        }
+        if (path)
+            error("引数の個数が正しくありません");
+        path = argv[i];
+    }
+    if (server_path)
+        return;
+    if (!path)
+        error("引数の個数が正しくありません");
+    ctx.filename = path;
 }
 
-int align_to(int n, int align) {
-    return (n + align -1) & ~(align -1);
+// NINECC_SOCKET があればそのサーバでコンパイルし、つながらなければ
+// 自分でコンパイルする。--time-passes と --profile-use は標準エラー出力に
+// 書くことがあるので自分でする
+static bool build(char *source, FILE *out) {
+    char *sock = getenv("NINECC_SOCKET");
+    int ret;
+    if (!sock || ctx.time_passes || ctx.profile_use ||
+            !compile_remote(sock, &ctx, args, source, out, &ret))
+        ret = compile(&ctx, source, out);
+    if (ret)
+        fputs(ctx.error, stderr);
+    return ret == 0;
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        error("引数の個数が正しくありません");
-    }
-
-    filename = argv[1];
-    char *user_input = read_file(filename);
-    token = tokenize(user_input);
-    Program *prog = program();
-
-    for (Function *fn = prog->fns; fn; fn = fn->next) {
-        int offset = 0;
-        for(VarList *vl = fn->locals; vl; vl = vl->next) {
-            Var *var = vl->var;
-            offset += var->ty->size;
-            var->offset = offset;
-        }
-        fn->stack_size = align_to(offset, 8);
+    init_context(&ctx);
+    parse_args(argc, argv);
+    if (server_path) {
+        run_server(server_path);
+        return 0;
     }
+    char *user_input = read_file(ctx.filename);
 
-    codegen(prog);
+    if (!opt_run)
+        return build(user_input, stdout) ? 0 : 1;
 
-    return 0;
+    // --run: アセンブリをメモリ上に出力してそのまま実行する
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    if (!build(user_input, out))
+        return 1;
+    fclose(out);
+    return jit_run(buf);
 }
@@ -2,11 +2,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <setjmp.h>
 #include <stdio.h>
 
 typedef struct Type Type;
@@ -20,33 +23,79 @@ typedef enum {
     TK_STR, // string
 } TokenKind;
 
-typedef struct Token Token;
+// 記号と予約語。TK_RESERVED のトークンはどれか一つを持つ。
+typedef enum {
+    PU_NONE,
+    PU_ADD, // +
+    PU_SUB, // -
+    PU_MUL, // *
+    PU_DIV, // /
+    PU_LPAREN, // (
+    PU_RPAREN, // )
+    PU_LT, // <
+    PU_GT, // >
+    PU_SEMICOLON, // ;
+    PU_ASSIGN, // =
+    PU_LBRACE, // {
+    PU_RBRACE, // }
+    PU_COMMA, // ,
+    PU_AMP, // &
+    PU_LBRACKET, // [
+    PU_RBRACKET, // ]
+    PU_EQ, // ==
+    PU_NE, // !=
+    PU_LE, // <=
+    PU_GE, // >=
+    PU_COLON, // :
+    PU_NOT, // !
+    PU_LOGAND, // &&
+    PU_LOGOR, // ||
+    KW_RETURN,
+    KW_IF,
+    KW_ELSE,
+    KW_WHILE,
+    KW_FOR,
+    KW_INT,
+    KW_SIZEOF,
+    KW_CHAR,
+    KW_SWITCH,
+    KW_CASE,
+    KW_DEFAULT,
+    KW_BREAK,
+    NUM_RESERVED,
+} Reserved;
 
-struct Token {
-    TokenKind kind;
-    Token *next;
-    int val;
-    char *str;
-    int len;
-    char *contents;
-    int cont_len;
-};
+// トークンは 1 から始まる通し番号で表す。0 はトークンがないことを表す。
+typedef uint32_t Token;
+
+TokenKind tok_kind(Token tok);
+Reserved tok_reserved(Token tok);
+char *tok_str(Token tok);
+int tok_len(Token tok);
+char *tok_contents(Token tok);
+int tok_cont_len(Token tok);
 
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
-void error_tok(Token *tok, char *fmt, ...);
+void error_tok(Token tok, char *fmt, ...);
+
+// compile() の中では error は終了せず、メッセージを error_msg に置いて
+// error_jmp へ戻る
+extern _Thread_local jmp_buf *error_jmp;
+extern _Thread_local char *error_msg;
 
-Token *peek(char *s);
-Token *tokenize(char *input);
-Token *consume(char *op);
-Token *consume_ident();
+Token peek(Reserved op);
+Token tokenize(char *input);
+Token advance();
+char *consume(Reserved op);
+Token consume_ident();
 long expect_number();
-void expect(char *op);
+void expect(Reserved op);
 bool at_eof();
 char *expect_ident();
 
-extern char *filename;
-extern Token *token;
+extern _Thread_local char *filename;
+extern _Thread_local Token token;
 
 typedef struct Var Var;
 
@@ -54,7 +103,11 @@ struct Var {
     char *name;
     Type *ty;
     bool is_local;
+    bool addr_taken; // & が適用された
     int offset;
+    int reg; // 0 でなければ callee-saved レジスタの番号 (1 から)
+    bool is_temp; // コンパイラが作った一時変数
+    int refcnt; // 参照された回数
     char *contents;
     int cont_len;
 };
@@ -80,12 +133,18 @@ typedef enum {
     ND_NE, // !=
     ND_LT, // <
     ND_LE, // <=
+    ND_LOGAND, // &&
+    ND_LOGOR, // ||
+    ND_NOT, // !
     ND_ASSIGN, // =
     ND_VAR, // Variable
     ND_RETURN, // Return
     ND_IF, // IF
     ND_WHILE, // WHILE
     ND_FOR, // FOR
+    ND_SWITCH, // switch
+    ND_CASE, // case, default
+    ND_BREAK, // break
     ND_BLOCK, // Block {}
     ND_FUNCALL, // Function cal
     ND_EXPR_STMT, // Expression statement
@@ -95,25 +154,69 @@ typedef enum {
 } NodeKind;
 
 // Ast Node
+//
+// 全ての Node に共通するのはヘッダ部分だけで、残りは種別ごとに
+// 使うフィールドが違うので共用体に重ねる。new_node() は種別に
+// 必要な大きさしか確保しないので、その種別で使わないフィールドに
+// 触ってはいけない。
 typedef struct Node Node;
+typedef struct VecLoop VecLoop;
 
 struct Node {
     NodeKind kind; //種別
-    Node *lhs; // 左辺
-    Node *rhs; // 右辺
+    short need; // 評価に要るスタックの深さ. 0 なら未計算
+    bool pure; // 副作用がない
     Node *next; // 次のNode
-    Token *tok; // Token
-    Var *var; // ND_VARの時に使う 変数の名前
-    long val;  // 値
-    Node *cond; // if cond
-    Node *then; // if then
-    Node *els; // if else
-    Node *init; // for init
-    Node *inc; // for increment
-    Node *body; // {} Block
-    char *funcname; // funcion call name
-    Node *args; // function args
     Type *ty; // type, e.g. int or pointer to int
+    char *loc; // エラー表示用のソース上の位置
+
+    union {
+        // 演算子, ND_RETURN, ND_EXPR_STMT
+        struct {
+            Node *lhs; // 左辺
+            Node *rhs; // 右辺
+        };
+
+        // ND_IF, ND_WHILE, ND_FOR, ND_SWITCH, ND_CASE
+        struct {
+            Node *cond; // if cond, switch の式
+            Node *then; // if then, switch の本体, case の後の文
+            Node *els; // if else
+            Node *init; // for init
+            Node *inc; // for increment
+            int counter; // プロファイルのカウンタ番号
+            VecLoop *vec; // ND_FOR をベクトル化するとき
+            Node *case_next; // ND_SWITCH では最初の case, ND_CASE では次の case
+            Node *default_case; // ND_SWITCH
+            long case_val; // ND_CASE
+            int case_label; // ND_CASE のラベル番号
+        };
+
+        // ND_BLOCK
+        Node *body; // {} Block
+
+        // ND_FUNCALL
+        struct {
+            char *funcname; // funcion call name
+            Node *args; // function args
+        };
+
+        Var *var; // ND_VARの時に使う 変数の名前
+        long val;  // ND_NUMの値
+    };
+};
+
+// ベクトル化する for ループ。
+// dst[i] = src[0][i] op src[1][i] か acc = acc + src[0][i]
+struct VecLoop {
+    Node *i; // 添字の変数
+    Node *end; // 上限 (定数か変数)
+    bool inclusive; // i <= end
+    int size; // 要素の大きさ
+    Node *dst; // 書き込む配列. 総和のときは NULL
+    Node *src[2]; // 読む配列. src[1] はないこともある
+    NodeKind op; // ND_ADD か ND_SUB
+    Node *acc; // 総和を足し込む変数
 };
 
 typedef struct Function Function;
@@ -125,6 +228,8 @@ struct Function {
     Node *node;
     VarList *locals;
     int stack_size;
+    int nregs; // 使う callee-saved レジスタの数
+    int counter; // プロファイルのカウンタ番号
 };
 
 typedef struct {
@@ -134,6 +239,12 @@ typedef struct {
 } Program;
 
 Program *program();
+Node *new_node(NodeKind kind, char *loc);
+Node *new_num(long num, char *loc);
+Node *new_unary(NodeKind kind, Node *lhs, char *loc);
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, char *loc);
+Node *new_var_node(Var *var, char *loc);
+Node *copy_node(Node *node);
 
 typedef enum {
     TY_INT,
@@ -145,6 +256,7 @@ typedef enum {
 struct Type {
     TypeKind kind;
     int size; // sizeof() value
+    int align; // alignment
     Type *base; // pointer
     int array_len;
 };
@@ -157,5 +269,63 @@ Type *pointer_to(Type *base);
 Type *array_of(Type *base, int size);
 void add_type(Node *node);
 
+// profile
+extern _Thread_local char *profile_generate;
+extern _Thread_local char *profile_use;
+extern _Thread_local int num_counters;
+extern _Thread_local bool time_functions;
+void assign_counters(Program *prog);
+bool has_profile();
+long profile_count(int id);
+
+// compile
+#define MAX_PASSES 8
+
+// 一回のコンパイルの設定と結果。init_context で既定値を入れてから使う。
+// 一つの Context を同時に二つのスレッドで使ってはいけない
+typedef struct {
+    char *filename; // エラーメッセージに出す名前
+    int opt_level;
+    signed char pass_flags[MAX_PASSES]; // 1 なら -f, -1 なら -fno-
+    int unroll_factor;
+    bool time_passes;
+    bool time_functions;
+    char *profile_generate;
+    char *profile_use;
+    char *error; // compile が失敗したときのメッセージ. free で解放する
+} Context;
+
+void init_context(Context *ctx);
+char *parse_option(Context *ctx, char *arg);
+int compile(Context *ctx, char *source, FILE *out);
+void *arena_alloc(size_t size);
+char *arena_strndup(char *p, size_t len);
+
+// passes
+bool set_pass(Context *ctx, char *name, bool enable);
+void run_passes(Program *prog, Context *ctx);
+
+// vectorize
+int vectorize_loops(Program *prog);
+
+// unroll
+extern _Thread_local int unroll_factor;
+int unroll_loops(Program *prog);
+
+// ivopt
+int reduce_induction_vars(Program *prog);
+
+// cse
+int eliminate_common_subexprs(Program *prog);
+
 // codegen
-void codegen(Program *prog);
+void assign_regs(Function *fn);
+void codegen(Program *prog, FILE *out);
+
+// jit
+int jit_run(char *asm_text);
+
+// server
+void run_server(char *path);
+bool compile_remote(char *path, Context *ctx, char **args, char *source,
+                    FILE *out, int *ret);
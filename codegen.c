@@ -3,20 +3,102 @@
 static char *argreg1[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
 static char *argreg8[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 
-static int labelseq = 1;
-static char *funcname;
+// ローカル変数を置く callee-saved レジスタ。Var.reg は 1 から数える
+static char *varreg[] = {"rbx", "r12", "r13", "r14", "r15"};
+#define NUM_VARREGS (int)(sizeof(varreg) / sizeof(*varreg))
+
+static _Thread_local FILE *output_file;
+static _Thread_local int labelseq = 1;
+static _Thread_local char *funcname;
+static _Thread_local Function *current_fn;
+static _Thread_local bool can_tail_call;
+static _Thread_local int brkseq; // break で飛ぶ .L.end の番号
 
 static void gen(Node *node);
 
+static void emit(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(output_file, fmt, ap);
+    va_end(ap);
+}
+
+// 式を評価するのに一時的に積むスタックの深さ (Sethi–Ullman 数) と
+// 副作用の有無を求め、ノードに覚えておく
+static int need(Node *node) {
+    if (node->need)
+        return node->need;
+
+    int n = 1;
+    bool pure = true;
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_VAR:
+            break;
+        case ND_ADDR:
+        case ND_DEREF:
+        case ND_NOT:
+            n = need(node->lhs);
+            pure = node->lhs->pure;
+            break;
+        case ND_LOGAND:
+        case ND_LOGOR: {
+            // 両辺は別々に評価して捨てる
+            int l = need(node->lhs);
+            int r = need(node->rhs);
+            n = l > r ? l : r;
+            pure = node->lhs->pure && node->rhs->pure;
+            break;
+        }
+        case ND_ASSIGN: {
+            int l = need(node->lhs);
+            int r = need(node->rhs);
+            n = l > r + 1 ? l : r + 1;
+            pure = false;
+            break;
+        }
+        case ND_FUNCALL: {
+            int i = 0;
+            for (Node *arg = node->args; arg; arg = arg->next, i++)
+                if (need(arg) + i > n)
+                    n = need(arg) + i;
+            pure = false;
+            break;
+        }
+        default: {
+            int l = need(node->lhs);
+            int r = need(node->rhs);
+            pure = node->lhs->pure && node->rhs->pure;
+            if (pure && l != r)
+                n = l > r ? l : r;
+            else if (pure)
+                n = l + 1;
+            else
+                n = l > r + 1 ? l : r + 1;
+            break;
+        }
+    }
+    node->need = n;
+    node->pure = pure;
+    return n;
+}
+
+// 両辺に副作用がなく、右辺の方が深いときは右辺から評価する
+static bool rhs_first(Node *node) {
+    int l = need(node->lhs);
+    int r = need(node->rhs);
+    return node->pure && r > l;
+}
+
 static void gen_addr(Node *node) {
     switch (node->kind) {
         case ND_VAR: {
             Var *var = node->var;
             if (var->is_local) {
-                printf("  lea rax, [rbp-%d]\n", node->var->offset);
-                printf("  push rax\n");
+                emit("  lea rax, [rbp-%d]\n", node->var->offset);
+                emit("  push rax\n");
             } else {
-                printf("  push offset %s\n", var->name);
+                emit("  push offset %s\n", var->name);
             }
             return;
         }
@@ -24,35 +106,612 @@ static void gen_addr(Node *node) {
             gen(node->lhs);
             return;
         default:
-            error_tok(node->tok, "代入の左辺値が変数ではありません");
+            error_at(node->loc, "代入の左辺値が変数ではありません");
+    }
+}
+
+// メモリオペランド [base + index*scale + disp]。ベースと添字は
+// rbp や変数のレジスタならそのまま使い、そうでなければ式を評価して
+// 一時的なレジスタに入れる
+typedef struct {
+    Node *base; // 評価してベースにする式
+    char *breg; // そのままベースにするレジスタ
+    char *sym; // グローバル変数
+    Node *index; // 評価して添字にする式
+    char *ireg; // そのまま添字にするレジスタ
+    int scale;
+    long disp;
+} Mem;
+
+static bool is_scale(int n) {
+    return n == 1 || n == 2 || n == 4 || n == 8;
+}
+
+static void match_var(Var *var, Mem *m) {
+    if (var->is_local) {
+        m->breg = "rbp";
+        m->disp -= var->offset;
+    } else {
+        m->sym = var->name;
     }
 }
 
-static void gen_lval(Node *node) {
-    if (node->ty->kind == TY_ARRAY)
-        error_tok(node->tok, "左辺値ではありません");
-    gen_addr(node);
+// アドレスの式 node を Mem に分解する。定数を足し引きした分は変位に、
+// 添字は一つだけ index に、配列の変数と変数のレジスタはベースにする
+static void match_addr(Node *node, Mem *m) {
+    Node *orig = node;
+    for (;;) {
+        bool ptr_arith = node->kind == ND_PTR_ADD || node->kind == ND_PTR_SUB;
+        if (ptr_arith && node->rhs->kind == ND_NUM) {
+            long d = node->rhs->val * node->ty->base->size;
+            m->disp += node->kind == ND_PTR_ADD ? d : -d;
+            node = node->lhs;
+            continue;
+        }
+        if (node->kind == ND_PTR_ADD && !m->scale && is_scale(node->ty->base->size)) {
+            m->scale = node->ty->base->size;
+            if (node->rhs->kind == ND_VAR && node->rhs->var->reg)
+                m->ireg = varreg[node->rhs->var->reg - 1];
+            else
+                m->index = node->rhs;
+            node = node->lhs;
+            continue;
+        }
+        break;
+    }
+
+    if (node->kind == ND_VAR && node->ty->kind == TY_ARRAY)
+        match_var(node->var, m);
+    else if (node->kind == ND_VAR && node->var->reg)
+        m->breg = varreg[node->var->reg - 1];
+    else
+        m->base = node;
+
+    // 変位が 32 ビットに収まらなければ全体を計算する
+    if (m->disp != (int)m->disp)
+        *m = (Mem){.base = orig};
 }
 
-static void load(Type *ty) {
-    printf("  pop rax\n");
+// 左辺値 node (変数か *式) を Mem にする
+static void match_mem(Node *node, Mem *m) {
+    *m = (Mem){0};
+    if (node->kind == ND_VAR)
+        match_var(node->var, m);
+    else if (node->kind == ND_DEREF)
+        match_addr(node->lhs, m);
+    else
+        error_at(node->loc, "代入の左辺値が変数ではありません");
+}
+
+// ベースと添字の式を評価してスタックに積む
+static void gen_mem(Mem *m) {
+    if (m->base)
+        gen(m->base);
+    if (m->index)
+        gen(m->index);
+}
+
+// gen_mem で積んだ値を breg と ireg に取り出し、オペランドの文字列を返す
+static char *pop_mem(Mem *m, char *breg, char *ireg) {
+    static _Thread_local char buf[80];
+    if (m->index)
+        emit("  pop %s\n", ireg);
+    else
+        ireg = m->ireg;
+    if (m->base)
+        emit("  pop %s\n", breg);
+    else
+        breg = m->breg;
+
+    char *p = buf;
+    p += sprintf(p, "[%s", m->sym ? m->sym : breg);
+    if (m->sym && breg)
+        p += sprintf(p, "+%s", breg);
+    if (ireg && m->scale == 1)
+        p += sprintf(p, "+%s", ireg);
+    else if (ireg)
+        p += sprintf(p, "+%s*%d", ireg, m->scale);
+    if (m->disp)
+        p += sprintf(p, "%+ld", m->disp);
+    sprintf(p, "]");
+    return buf;
+}
 
-    if (ty->size == 1)
-        printf("  movsx rax, byte ptr [rax]\n");
+// 変数か *式 の値を読む
+static void gen_load(Node *node) {
+    Mem m;
+    match_mem(node, &m);
+    gen_mem(&m);
+    char *mem = pop_mem(&m, "rax", "rdi");
+    if (node->ty->size == 1)
+        emit("  movsx rax, byte ptr %s\n", mem);
     else
-        printf("  mov rax, [rax]\n");
-    printf("  push rax\n");
+        emit("  mov rax, %s\n", mem);
+    emit("  push rax\n");
 }
 
-static void store(Type *ty) {
-    printf("  pop rdi\n");
-    printf("  pop rax\n");
+static void gen_store(Node *node) {
+    if (node->lhs->ty->kind == TY_ARRAY)
+        error_at(node->lhs->loc, "左辺値ではありません");
 
-    if (ty->size == 1)
-        printf("  mov [rax], dil\n");
+    Mem m;
+    match_mem(node->lhs, &m);
+    gen_mem(&m);
+    gen(node->rhs);
+    emit("  pop rdi\n");
+    char *mem = pop_mem(&m, "rax", "rdx");
+    if (node->ty->size == 1)
+        emit("  mov %s, dil\n", mem);
     else
-        printf("  mov [rax], rdi\n");
-    printf("  push rdi\n");
+        emit("  mov %s, rdi\n", mem);
+    emit("  push rdi\n");
+}
+
+// 演算の右辺に直接書ける 8 バイトのメモリの読み出し
+static bool is_mem_operand(Node *node) {
+    if (node->ty->kind == TY_ARRAY || node->ty->size != 8)
+        return false;
+    return node->kind == ND_DEREF || (node->kind == ND_VAR && !node->var->reg);
+}
+
+// 二項演算子の両辺を評価し、左辺を rax に置いて右辺のオペランドを返す。
+// 右辺は rdi に置くが、fold のときメモリの読み出しはメモリオペランドのままにする
+static char *gen_operands(Node *node, bool fold) {
+    if (fold && !rhs_first(node) && is_mem_operand(node->rhs)) {
+        Mem m;
+        match_mem(node->rhs, &m);
+        gen(node->lhs);
+        gen_mem(&m);
+        char *mem = pop_mem(&m, "rdi", "rdx");
+        emit("  pop rax\n");
+        return mem;
+    }
+
+    if (rhs_first(node)) {
+        gen(node->rhs);
+        gen(node->lhs);
+        emit("  pop rax\n");
+        emit("  pop rdi\n");
+    } else {
+        gen(node->lhs);
+        gen(node->rhs);
+        emit("  pop rdi\n");
+        emit("  pop rax\n");
+    }
+    return "rdi";
+}
+
+// 比較の結果が truth になるときの条件コード
+static char *cond_code(NodeKind kind, bool truth) {
+    switch (kind) {
+        case ND_EQ: return truth ? "e" : "ne";
+        case ND_NE: return truth ? "ne" : "e";
+        case ND_LT: return truth ? "l" : "ge";
+        default: return truth ? "le" : "g";
+    }
+}
+
+// 条件 node の真偽が truth と一致すれば label へ飛び、そうでなければ
+// 次へ進む。&&, ||, ! と比較は値を作らずに分岐だけにする
+static void gen_branch(Node *node, bool truth, char *label) {
+    switch (node->kind) {
+        case ND_NOT:
+            gen_branch(node->lhs, !truth, label);
+            return;
+        case ND_LOGAND:
+        case ND_LOGOR: {
+            // a && b が偽, a || b が真になるのは左辺だけで決まることがある
+            bool shortcut = node->kind == ND_LOGOR;
+            if (truth == shortcut) {
+                gen_branch(node->lhs, truth, label);
+                gen_branch(node->rhs, truth, label);
+                return;
+            }
+            char skip[32];
+            sprintf(skip, ".L.skip.%d", labelseq++);
+            gen_branch(node->lhs, shortcut, skip);
+            gen_branch(node->rhs, truth, label);
+            emit("%s:\n", skip);
+            return;
+        }
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE: {
+            char *rhs = gen_operands(node, true);
+            emit("  cmp rax, %s\n", rhs);
+            emit("  j%s %s\n", cond_code(node->kind, truth), label);
+            return;
+        }
+        default:
+            gen(node);
+            emit("  pop rax\n");
+            emit("  cmp rax, 0\n");
+            emit("  j%s %s\n", truth ? "ne" : "e", label);
+            return;
+    }
+}
+
+// cond の真偽が truth なら .L.<name>.<seq> へ飛ぶ
+static void branch_to(Node *cond, bool truth, char *name, int seq) {
+    char label[32];
+    sprintf(label, ".L.%s.%d", name, seq);
+    gen_branch(cond, truth, label);
+}
+
+// --profile-generate のときカウンタを一つ増やす
+static void count(int id) {
+    if (profile_generate)
+        emit("  inc qword ptr [rip + .L.prof + %d]\n", (id + 1) * 8);
+}
+
+static void gen_arm(Node *node, int id) {
+    count(id);
+    if (node)
+        gen(node);
+}
+
+// a の枝が b の枝に比べて滅多に通らない
+static bool is_cold(long a, long b) {
+    return b > 0 && a * 16 < b;
+}
+
+// 関数のエピローグの後ろに置く枝
+typedef struct ColdBlock ColdBlock;
+
+struct ColdBlock {
+    ColdBlock *next;
+    Node *node;
+    int counter;
+    int seq;
+    int brkseq;
+};
+
+static _Thread_local ColdBlock *cold_blocks;
+
+static void defer_cold(Node *node, int counter, int seq) {
+    ColdBlock *cb = arena_alloc(sizeof(ColdBlock));
+    cb->node = node;
+    cb->counter = counter;
+    cb->seq = seq;
+    cb->brkseq = brkseq;
+
+    ColdBlock **p = &cold_blocks;
+    while (*p)
+        p = &(*p)->next;
+    *p = cb;
+}
+
+static void emit_cold_blocks() {
+    while (cold_blocks) {
+        ColdBlock *cb = cold_blocks;
+        emit(".L.cold.%d:\n", cb->seq);
+        brkseq = cb->brkseq;
+        gen_arm(cb->node, cb->counter);
+        emit("  jmp .L.end.%d\n", cb->seq);
+        cold_blocks = cb->next;
+    }
+}
+
+// 引数がスタック上のローカル変数を指している可能性があると
+// フレームを先に破棄できないので末尾呼び出しにしない。
+static bool has_escaping_local(Function *fn) {
+    for (VarList *vl = fn->locals; vl; vl = vl->next) {
+        Var *var = vl->var;
+        if (var->addr_taken || var->ty->kind == TY_ARRAY)
+            return true;
+    }
+    return false;
+}
+
+// 並べ替える変数と、その宣言の順番
+typedef struct {
+    Var *var;
+    int order;
+} RankedVar;
+
+// 変数のリストは新しいものが先頭なので、宣言順は後ろから数える
+static RankedVar *rank_vars(VarList *vars, int *n, bool (*want)(Var *)) {
+    int len = 0;
+    for (VarList *vl = vars; vl; vl = vl->next)
+        len++;
+    RankedVar *ranked = calloc(len, sizeof(RankedVar));
+    int order = len;
+    *n = 0;
+    for (VarList *vl = vars; vl; vl = vl->next) {
+        order--;
+        if (want(vl->var))
+            ranked[(*n)++] = (RankedVar){vl->var, order};
+    }
+    return ranked;
+}
+
+// 参照の多い変数から順に並べる。同じなら宣言順
+static int cmp_refcnt(const void *x, const void *y) {
+    const RankedVar *a = x;
+    const RankedVar *b = y;
+    if (a->var->refcnt != b->var->refcnt)
+        return a->var->refcnt > b->var->refcnt ? -1 : 1;
+    return (a->order > b->order) - (a->order < b->order);
+}
+
+// アドレスを取られないスカラのローカル変数を、参照の多い順に
+// callee-saved レジスタへ割り当てる。呼び出しをまたいでも値が残る。
+// フレームを指すポインタがあると隣の変数にも届きうるので、
+// そういう関数ではコンパイラの一時変数だけを割り当てる
+static _Thread_local bool regs_temps_only;
+
+static bool want_reg(Var *var) {
+    return var->refcnt > 0 && (!regs_temps_only || var->is_temp);
+}
+
+void assign_regs(Function *fn) {
+    regs_temps_only = has_escaping_local(fn);
+
+    int n;
+    RankedVar *vars = rank_vars(fn->locals, &n, want_reg);
+    qsort(vars, n, sizeof(RankedVar), cmp_refcnt);
+
+    fn->nregs = n < NUM_VARREGS ? n : NUM_VARREGS;
+    for (int i = 0; i < fn->nregs; i++)
+        vars[i].var->reg = i + 1;
+    free(vars);
+}
+
+static void save_regs(Function *fn) {
+    for (int i = 0; i < fn->nregs; i++)
+        emit("  mov [rbp-%d], %s\n", (i + 1) * 8, varreg[i]);
+}
+
+static void restore_regs(Function *fn) {
+    for (int i = 0; i < fn->nregs; i++)
+        emit("  mov %s, [rbp-%d]\n", varreg[i], (i + 1) * 8);
+}
+
+// スカラのローカル変数に reg の値を入れる
+static void store_var(Var *var, char *reg) {
+    if (var->reg)
+        emit("  mov %s, %s\n", varreg[var->reg - 1], reg);
+    else
+        emit("  mov [rbp-%d], %s\n", var->offset, reg);
+}
+
+// 16 バイトずつ進むループ。i は先に進めて戻し、残りは元のループに任せる。
+// rcx: i, r8: 上限, rdx: dst, rsi: src[0], rdi: src[1]
+static void gen_vector_loop(VecLoop *v) {
+    int seq = labelseq++;
+    int lanes = 16 / v->size;
+    char *scale = v->size == 8 ? "*8" : "";
+    char *add = v->size == 8 ? "paddq" : "paddb";
+    char *sub = v->size == 8 ? "psubq" : "psubb";
+
+    gen(v->end);
+    gen(v->i);
+    if (v->dst)
+        gen(v->dst);
+    gen(v->src[0]);
+    if (v->src[1])
+        gen(v->src[1]);
+    if (v->src[1])
+        emit("  pop rdi\n");
+    emit("  pop rsi\n");
+    if (v->dst)
+        emit("  pop rdx\n");
+    emit("  pop rcx\n");
+    emit("  pop r8\n");
+    if (v->inclusive)
+        emit("  add r8, 1\n");
+
+    // 書き込み先と読み出し元が 16 バイト未満ずれて重なるなら使わない
+    for (int k = 0; v->dst && k < 2 && v->src[k]; k++) {
+        if (v->dst->var->ty->kind == TY_ARRAY && v->src[k]->var->ty->kind == TY_ARRAY)
+            continue;
+        char *src = k ? "rdi" : "rsi";
+        emit("  mov rax, rdx\n");
+        emit("  sub rax, %s\n", src);
+        emit("  je .L.vec.ok.%d.%d\n", seq, k);
+        emit("  cmp rax, -16\n");
+        emit("  jle .L.vec.ok.%d.%d\n", seq, k);
+        emit("  cmp rax, 16\n");
+        emit("  jl .L.vec.end.%d\n", seq);
+        emit(".L.vec.ok.%d.%d:\n", seq, k);
+    }
+
+    if (v->acc)
+        emit("  pxor xmm0, xmm0\n");
+    emit(".L.vec.begin.%d:\n", seq);
+    emit("  lea rax, [rcx+%d]\n", lanes);
+    emit("  cmp rax, r8\n");
+    emit("  jg .L.vec.end.%d\n", seq);
+    if (v->acc) {
+        emit("  movdqu xmm1, [rsi+rcx%s]\n", scale);
+        emit("  %s xmm0, xmm1\n", add);
+    } else {
+        emit("  movdqu xmm0, [rsi+rcx%s]\n", scale);
+        if (v->src[1]) {
+            emit("  movdqu xmm1, [rdi+rcx%s]\n", scale);
+            emit("  %s xmm0, xmm1\n", v->op == ND_SUB ? sub : add);
+        }
+        emit("  movdqu [rdx+rcx%s], xmm0\n", scale);
+    }
+    emit("  add rcx, %d\n", lanes);
+    emit("  jmp .L.vec.begin.%d\n", seq);
+    emit(".L.vec.end.%d:\n", seq);
+    store_var(v->i->var, "rcx");
+
+    // 二つのレーンを足して s に加える
+    if (v->acc) {
+        emit("  pshufd xmm1, xmm0, 78\n");
+        emit("  paddq xmm0, xmm1\n");
+        gen(v->acc);
+        emit("  pop rax\n");
+        emit("  movq rdx, xmm0\n");
+        emit("  add rax, rdx\n");
+        store_var(v->acc->var, "rax");
+    }
+}
+
+static void gen_loop(Node *node) {
+    int seq = labelseq++;
+    int c = node->counter;
+    if (node->init)
+        gen(node->init);
+    count(c);
+    brkseq = seq;
+    if (node->kind == ND_FOR && node->vec)
+        gen_vector_loop(node->vec);
+
+    // 何度も回るループは条件を末尾に置いて分岐を一つにする
+    if (profile_count(c + 1) > profile_count(c)) {
+        emit("  jmp .L.cond.%d\n", seq);
+        emit(".L.begin.%d:\n", seq);
+        gen_arm(node->then, c + 1);
+        if (node->inc)
+            gen(node->inc);
+        emit(".L.cond.%d:\n", seq);
+        if (node->cond) {
+            branch_to(node->cond, true, "begin", seq);
+        } else {
+            emit("  jmp .L.begin.%d\n", seq);
+        }
+        emit(".L.end.%d:\n", seq);
+        return;
+    }
+
+    emit(".L.begin.%d:\n", seq);
+    if (node->cond)
+        branch_to(node->cond, false, "end", seq);
+    gen_arm(node->then, c + 1);
+    if (node->inc)
+        gen(node->inc);
+    emit("  jmp .L.begin.%d\n", seq);
+    emit(".L.end.%d:\n", seq);
+}
+
+// switch の分岐。case の値が密に並んでいれば .rodata の表を引いて
+// 一度で飛び、まばらなら値を二分探索する
+#define MIN_JUMP_TABLE 4 // 表を作る case の数の下限
+#define MAX_JUMP_TABLE 4096 // 表の大きさの上限
+
+static int cmp_case(const void *x, const void *y) {
+    long a = (*(Node **)x)->case_val;
+    long b = (*(Node **)y)->case_val;
+    return a < b ? -1 : a > b;
+}
+
+// rax と定数を比べる。32 ビットに収まらない値は rdi に入れる
+static void cmp_rax(long val) {
+    if (val == (int)val) {
+        emit("  cmp rax, %ld\n", val);
+        return;
+    }
+    emit("  mov rdi, %ld\n", val);
+    emit("  cmp rax, rdi\n");
+}
+
+// cases[lo..hi) の中から rax と等しい値を探し、なければ dflt へ飛ぶ
+static void gen_case_search(Node **cases, int lo, int hi, char *dflt) {
+    if (hi - lo <= 3) {
+        for (int i = lo; i < hi; i++) {
+            cmp_rax(cases[i]->case_val);
+            emit("  je .L.case.%d\n", cases[i]->case_label);
+        }
+        emit("  jmp %s\n", dflt);
+        return;
+    }
+
+    int mid = (lo + hi) / 2;
+    int seq = labelseq++;
+    cmp_rax(cases[mid]->case_val);
+    emit("  je .L.case.%d\n", cases[mid]->case_label);
+    emit("  jl .L.search.%d\n", seq);
+    gen_case_search(cases, mid + 1, hi, dflt);
+    emit(".L.search.%d:\n", seq);
+    gen_case_search(cases, lo, mid, dflt);
+}
+
+static void gen_switch(Node *node) {
+    int seq = labelseq++;
+    brkseq = seq;
+
+    int n = 0;
+    for (Node *c = node->case_next; c; c = c->case_next) {
+        c->case_label = labelseq++;
+        n++;
+    }
+    Node **cases = calloc(n, sizeof(Node *));
+    n = 0;
+    for (Node *c = node->case_next; c; c = c->case_next)
+        cases[n++] = c;
+    qsort(cases, n, sizeof(Node *), cmp_case);
+
+    char dflt[32];
+    if (node->default_case) {
+        node->default_case->case_label = labelseq++;
+        sprintf(dflt, ".L.case.%d", node->default_case->case_label);
+    } else {
+        sprintf(dflt, ".L.end.%d", seq);
+    }
+
+    gen(node->cond);
+    emit("  pop rax\n");
+
+    // 値の幅が case の数の 3 倍以内なら表にする
+    unsigned long range =
+        n ? (unsigned long)cases[n - 1]->case_val - (unsigned long)cases[0]->case_val : 0;
+    if (n >= MIN_JUMP_TABLE && range < 3UL * n && range < MAX_JUMP_TABLE) {
+        long min = cases[0]->case_val;
+        if (min == (int)min) {
+            emit("  sub rax, %ld\n", min);
+        } else {
+            emit("  mov rdi, %ld\n", min);
+            emit("  sub rax, rdi\n");
+        }
+        emit("  cmp rax, %lu\n", range);
+        emit("  ja %s\n", dflt);
+        emit("  jmp [.L.jt.%d+rax*8]\n", seq);
+
+        emit(".section .rodata\n");
+        emit("  .align 8\n");
+        emit(".L.jt.%d:\n", seq);
+        int i = 0;
+        for (unsigned long val = 0; val <= range; val++) {
+            if ((unsigned long)cases[i]->case_val - (unsigned long)min == val)
+                emit("  .quad .L.case.%d\n", cases[i++]->case_label);
+            else
+                emit("  .quad %s\n", dflt);
+        }
+        emit(".text\n");
+    } else {
+        gen_case_search(cases, 0, n, dflt);
+    }
+    free(cases);
+
+    gen(node->then);
+    emit(".L.end.%d:\n", seq);
+}
+
+static void gen_args(Node *args) {
+    int nargs = 0;
+    for (Node *arg = args; arg; arg = arg->next) {
+        gen(arg);
+        nargs++;
+    }
+
+    for (int i = nargs - 1; i >= 0; i--) {
+        emit("  pop %s\n", argreg8[i]);
+    }
+}
+
+// return f(...) は自分のフレームを破棄してから f へ jmp する。
+// 戻りアドレスはそのまま残るので f の ret が呼び出し元へ直接戻る。
+static void gen_tail_call(Node *node) {
+    gen_args(node->args);
+    restore_regs(current_fn);
+    emit("  mov rax, 0\n");
+    emit("  mov rsp, rbp\n");
+    emit("  pop rbp\n");
+    emit("  jmp %s\n", node->funcname);
 }
 
 static void gen(Node *node) {
@@ -60,85 +719,132 @@ static void gen(Node *node) {
         case ND_NULL:
             return;
         case ND_NUM:
-            printf("  push %ld\n", node->val);
+            emit("  push %ld\n", node->val);
             return;
         case ND_EXPR_STMT:
           gen(node->lhs);
-          printf("  add rsp, 8\n");
+          emit("  add rsp, 8\n");
           return;
         case ND_VAR:
-            gen_addr(node);
-            if (node->ty->kind != TY_ARRAY)
-                load(node->ty);
+            if (node->var->reg) {
+                emit("  push %s\n", varreg[node->var->reg - 1]);
+                return;
+            }
+            if (node->ty->kind == TY_ARRAY)
+                gen_addr(node);
+            else
+                gen_load(node);
             return;
         case ND_ASSIGN:
-            gen_lval(node->lhs);
-            gen(node->rhs);
-            store(node->ty);
+            // レジスタの char は符号拡張した値で持つ
+            if (node->lhs->kind == ND_VAR && node->lhs->var->reg) {
+                char *reg = varreg[node->lhs->var->reg - 1];
+                gen(node->rhs);
+                emit("  pop rax\n");
+                if (node->ty->size == 1)
+                    emit("  movsx rax, al\n");
+                emit("  mov %s, rax\n", reg);
+                emit("  push rax\n");
+                return;
+            }
+            gen_store(node);
             return;
         case ND_RETURN:
+            if (node->lhs->kind == ND_FUNCALL && can_tail_call) {
+                gen_tail_call(node->lhs);
+                return;
+            }
             gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  jmp .L.return.%s\n", funcname);
+            emit("  pop rax\n");
+            emit("  jmp .L.return.%s\n", funcname);
             return;
         case ND_ADDR:
             gen_addr(node->lhs);
             return;
         case ND_DEREF:
-            gen(node->lhs);
-            if (node->ty->kind != TY_ARRAY)
-                load(node->ty);
+            if (node->ty->kind == TY_ARRAY)
+                gen(node->lhs);
+            else
+                gen_load(node);
             return;
         case ND_IF: {
             int seq = labelseq++;
-            if (node->els) {
-                gen(node->cond);
-                printf("  pop rax\n");
-                printf("  cmp rax, 0\n");
-                printf("  je  .L.else.%d\n", seq);
-                gen(node->then);
-                printf("  jmp .L.end.%d\n", seq);
-                printf(".L.else.%d:\n", seq);
-                gen(node->els);
-                printf(".L.end.%d:\n", seq);
-            } else {
-                gen(node->cond);
-                printf("  pop rax\n");
-                printf("  cmp rax, 0\n");
-                printf("  je  .L.end.%d\n", seq);
+            int c = node->counter;
+            long then_cnt = profile_count(c);
+            long else_cnt = profile_count(c + 1);
+
+            // 滅多に通らない枝は関数の後ろへ追い出す
+            if (is_cold(then_cnt, else_cnt)) {
+                branch_to(node->cond, true, "cold", seq);
+                gen_arm(node->els, c + 1);
+                emit(".L.end.%d:\n", seq);
+                defer_cold(node->then, c, seq);
+                return;
+            }
+            if (node->els && is_cold(else_cnt, then_cnt)) {
+                branch_to(node->cond, false, "cold", seq);
+                gen_arm(node->then, c);
+                emit(".L.end.%d:\n", seq);
+                defer_cold(node->els, c + 1, seq);
+                return;
+            }
+
+            // else の方がよく通るならそちらを fall-through にする
+            if (node->els && else_cnt > then_cnt) {
+                branch_to(node->cond, true, "then", seq);
+                gen_arm(node->els, c + 1);
+                emit("  jmp .L.end.%d\n", seq);
+                emit(".L.then.%d:\n", seq);
+                gen_arm(node->then, c);
+                emit(".L.end.%d:\n", seq);
+                return;
+            }
+
+            if (!node->els && !profile_generate) {
+                branch_to(node->cond, false, "end", seq);
                 gen(node->then);
-                printf(".L.end.%d:\n", seq);
+                emit(".L.end.%d:\n", seq);
+                return;
             }
+
+            branch_to(node->cond, false, "else", seq);
+            gen_arm(node->then, c);
+            emit("  jmp .L.end.%d\n", seq);
+            emit(".L.else.%d:\n", seq);
+            gen_arm(node->els, c + 1);
+            emit(".L.end.%d:\n", seq);
             return;
         }
-        case ND_WHILE: {
-            int seq = labelseq++;
-            printf(".L.begin.%d:\n", seq);
-            gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je .L.end.%d\n", seq);
-            gen(node->then);
-            printf("  jmp .L.begin.%d\n", seq);
-            printf(".L.end.%d:\n", seq);
+        case ND_WHILE:
+        case ND_FOR: {
+            int brk = brkseq;
+            gen_loop(node);
+            brkseq = brk;
             return;
         }
-        case ND_FOR: {
-            int seq = labelseq++;
-            if (node->init)
-                gen(node->init);
-            printf(".L.begin.%d:\n", seq);
-            if (node->cond) {
-                gen(node->cond);
-                printf("  pop rax\n");
-                printf("  cmp rax, 0\n");
-                printf("  je .L.end.%d\n", seq);
-            }
+        case ND_SWITCH: {
+            int brk = brkseq;
+            gen_switch(node);
+            brkseq = brk;
+            return;
+        }
+        case ND_CASE:
+            emit(".L.case.%d:\n", node->case_label);
             gen(node->then);
-            if (node->inc)
-                gen(node->inc);
-            printf("  jmp .L.begin.%d\n", seq);
-            printf(".L.end.%d:\n", seq);
+            return;
+        case ND_BREAK:
+            emit("  jmp .L.end.%d\n", brkseq);
+            return;
+        case ND_LOGAND:
+        case ND_LOGOR:
+        case ND_NOT: {
+            int seq = labelseq++;
+            branch_to(node, false, "false", seq);
+            emit("  push 1\n");
+            emit("  jmp .L.end.%d\n", seq);
+            emit(".L.false.%d:\n", seq);
+            emit("  push 0\n");
+            emit(".L.end.%d:\n", seq);
             return;
         }
         case ND_BLOCK:
@@ -146,154 +852,373 @@ static void gen(Node *node) {
                 gen(n);
             return;
         case ND_FUNCALL: {
-            int nargs = 0;
-            for (Node *arg = node->args; arg; arg = arg->next) {
-                gen(arg);
-                nargs++;
-            }
-
-            for (int i = nargs - 1; i >= 0; i--) {
-                printf("  pop %s\n", argreg8[i]);
-            }
+            gen_args(node->args);
 
             int seq = labelseq++;
-            printf("  mov rax, rsp\n");
-            printf("  and rax, 15\n");
-            printf("  jnz .L.call.%d\n", seq);
-            printf("  mov rax, 0\n");
-            printf("  call %s\n", node->funcname);
-            printf("  jmp .L.end.%d\n", seq);
-            printf(".L.call.%d:\n", seq);
-            printf("  sub rsp, 8\n");
-            printf("  mov rax, 0\n");
-            printf("  call %s\n", node->funcname);
-            printf("  add rsp, 8\n");
-            printf(".L.end.%d:\n", seq);
-            printf("  push rax\n");
+            emit("  mov rax, rsp\n");
+            emit("  and rax, 15\n");
+            emit("  jnz .L.call.%d\n", seq);
+            emit("  mov rax, 0\n");
+            emit("  call %s\n", node->funcname);
+            emit("  jmp .L.end.%d\n", seq);
+            emit(".L.call.%d:\n", seq);
+            emit("  sub rsp, 8\n");
+            emit("  mov rax, 0\n");
+            emit("  call %s\n", node->funcname);
+            emit("  add rsp, 8\n");
+            emit(".L.end.%d:\n", seq);
+            emit("  push rax\n");
             return;
         }
         default:
             break;
     }
 
-    gen(node->lhs);
-    gen(node->rhs);
-
-    printf("  pop rdi\n");
-    printf("  pop rax\n");
+    // DIV と PTR_* は rdi を書き換えたり rdi に割ったりするので畳まない
+    bool fold = node->kind != ND_DIV && node->kind != ND_PTR_ADD &&
+        node->kind != ND_PTR_SUB && node->kind != ND_PTR_DIFF;
+    char *rhs = gen_operands(node, fold);
 
     switch(node->kind) {
         case ND_ADD:
-            printf("  add rax, rdi\n");
+            emit("  add rax, %s\n", rhs);
             break;
         case ND_PTR_ADD:
-            printf("  imul rdi, %d\n", node->ty->base->size);
-            printf("  add rax, rdi\n");
+            if (is_scale(node->ty->base->size)) {
+                emit("  lea rax, [rax+rdi*%d]\n", node->ty->base->size);
+                break;
+            }
+            emit("  imul rdi, %d\n", node->ty->base->size);
+            emit("  add rax, rdi\n");
             break;
         case ND_SUB:
-            printf("  sub rax, rdi\n");
+            emit("  sub rax, %s\n", rhs);
             break;
         case ND_PTR_SUB:
-            printf("  imul rdi, %d\n", node->ty->base->size);
-            printf("  sub rax, rdi\n");
+            emit("  imul rdi, %d\n", node->ty->base->size);
+            emit("  sub rax, rdi\n");
             break;
         case ND_PTR_DIFF:
-            printf("  sub rax, rdi\n");
-            printf("  cqo\n");
-            printf("  mov rdi, %d\n", node->lhs->ty->base->size);
-            printf("  idiv rdi\n");
+            emit("  sub rax, rdi\n");
+            emit("  cqo\n");
+            emit("  mov rdi, %d\n", node->lhs->ty->base->size);
+            emit("  idiv rdi\n");
             break;
         case ND_MUL:
-            printf("  imul rax, rdi\n");
+            emit("  imul rax, %s\n", rhs);
             break;
         case ND_DIV:
-            printf("  cqo\n");
-            printf("  idiv rdi\n");
+            emit("  cqo\n");
+            emit("  idiv rdi\n");
             break;
         case ND_EQ:
-            printf("  cmp rax, rdi\n");
-            printf("  sete al\n");
-            printf("  movzb rax, al\n");
-            break;
         case ND_NE:
-            printf("  cmp rax, rdi\n");
-            printf("  setne al\n");
-            printf("  movzb rax, al\n");
-            break;
         case ND_LE:
-            printf("  cmp rax, rdi\n");
-            printf("  setle al\n");
-            printf("  movzb rax, al\n");
-            break;
         case ND_LT:
-            printf("  cmp rax, rdi\n");
-            printf("  setl al\n");
-            printf("  movzb rax, al\n");
+            emit("  cmp rax, %s\n", rhs);
+            emit("  set%s al\n", cond_code(node->kind, true));
+            emit("  movzb rax, al\n");
             break;
         default:
             break;
 
     }
-    printf("  push rax\n");
+    emit("  push rax\n");
 }
 
 static void load_arg(Var *var, int idx) {
     int sz = var->ty->size;
+    if (var->reg) {
+        char *reg = varreg[var->reg - 1];
+        if (sz == 1)
+            emit("  movsx %s, %s\n", reg, argreg1[idx]);
+        else
+            emit("  mov %s, %s\n", reg, argreg8[idx]);
+        return;
+    }
     if (sz == 1) {
-        printf("  mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
+        emit("  mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
     } else {
-        printf("  mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
+        emit("  mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
     }
 }
 
-static void emit_data(Program *prog) {
-    printf(".data\n");
+// len は終端の '\0' を含む長さ
+static void emit_string(char *str, int len) {
+    emit("  .string \"");
+    for (int i = 0; i < len - 1; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\')
+            emit("\\%c", c);
+        else if (isprint(c))
+            emit("%c", c);
+        else
+            emit("\\%03o", c);
+    }
+    emit("\"\n");
+}
 
-    for(VarList *vl = prog->globals; vl; vl = vl->next) {
-        Var *var = vl->var;
-        printf("%s:\n", var->name);
+// 末尾から比較する。a が b の接尾辞なら a は b の直前に並ぶ。
+static int cmp_suffix(const void *x, const void *y) {
+    Var *a = *(Var **)x;
+    Var *b = *(Var **)y;
+    for (int i = 1; i <= a->cont_len && i <= b->cont_len; i++) {
+        unsigned char ca = a->contents[a->cont_len - i];
+        unsigned char cb = b->contents[b->cont_len - i];
+        if (ca != cb)
+            return ca - cb;
+    }
+    return a->cont_len - b->cont_len;
+}
+
+static bool is_suffix(Var *a, Var *b) {
+    return a->cont_len <= b->cont_len &&
+        !memcmp(a->contents, b->contents + b->cont_len - a->cont_len, a->cont_len);
+}
+
+// 文字列リテラルは .rodata に置き、他のリテラルの接尾辞になっているものは
+// そのリテラルの途中を指すラベルにする。
+static void emit_strings(Program *prog) {
+    int n = 0;
+    for (VarList *vl = prog->globals; vl; vl = vl->next)
+        if (vl->var->contents)
+            n++;
+    if (n == 0)
+        return;
 
-        if (!var->contents) {
-            printf("  .zero %d\n", var->ty->size);
+    Var **strs = calloc(n, sizeof(Var *));
+    int i = 0;
+    for (VarList *vl = prog->globals; vl; vl = vl->next)
+        if (vl->var->contents)
+            strs[i++] = vl->var;
+    qsort(strs, n, sizeof(Var *), cmp_suffix);
+
+    emit(".section .rodata\n");
+    Var *owner = NULL;
+    for (i = n - 1; i >= 0; i--) {
+        Var *var = strs[i];
+        if (owner && is_suffix(var, owner)) {
+            emit(".set %s, %s+%d\n", var->name, owner->name,
+                   owner->cont_len - var->cont_len);
             continue;
         }
+        owner = var;
+        emit("%s:\n", var->name);
+        emit_string(var->contents, var->cont_len);
+    }
+    free(strs);
+}
 
-        for (int i = 0; i < var->cont_len; i++) {
-            printf("  .byte %d\n", var->contents[i]);
-        }
+// 1キャッシュライン以上の配列はキャッシュラインにそろえる
+static int global_align(Var *var) {
+    if (var->ty->kind == TY_ARRAY && var->ty->size >= 64)
+        return 64;
+    return var->ty->align;
+}
+
+// 初期値を持つグローバル変数はないので全て .bss に置く
+static bool is_bss(Var *var) {
+    return !var->contents;
+}
+
+static void emit_bss(Program *prog) {
+    int n;
+    RankedVar *vars = rank_vars(prog->globals, &n, is_bss);
+    if (n == 0) {
+        free(vars);
+        return;
+    }
+    qsort(vars, n, sizeof(RankedVar), cmp_refcnt);
+
+    emit(".bss\n");
+    for (int i = 0; i < n; i++) {
+        Var *var = vars[i].var;
+        emit("  .align %d\n", global_align(var));
+        emit("%s:\n", var->name);
+        emit("  .zero %d\n", var->ty->size);
     }
+    free(vars);
+}
+
+static void emit_data(Program *prog) {
+    emit_bss(prog);
+    emit_strings(prog);
+}
+
+// よく呼ばれる関数から順に並べる
+static int cmp_hotness(const void *x, const void *y) {
+    Function *a = *(Function **)x;
+    Function *b = *(Function **)y;
+    long ca = profile_count(a->counter);
+    long cb = profile_count(b->counter);
+    if (ca != cb)
+        return ca < cb ? 1 : -1;
+    return a->counter - b->counter;
+}
+
+static void emit_function(Function *fn) {
+    emit(".global %s\n", fn->name);
+    emit("%s:\n", fn->name);
+    funcname = fn->name;
+    current_fn = fn;
+    // 計測中は末尾呼び出しで出口のフックを飛ばさないようにする
+    can_tail_call = !has_escaping_local(fn) && !time_functions;
+
+    // prologue
+    emit("  push rbp\n");
+    emit("  mov rbp, rsp\n");
+    emit("  sub rsp, %d\n", fn->stack_size + (time_functions ? 8 : 0));
+    save_regs(fn);
+    count(fn->counter);
+
+    int i = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next) {
+        load_arg(vl->var, i++);
+    }
+
+    // 引数を退避した後なら rdx を壊してよい
+    if (time_functions) {
+        emit("  rdtsc\n");
+        emit("  shl rdx, 32\n");
+        emit("  or rax, rdx\n");
+        emit("  mov [rbp-%d], rax\n", fn->stack_size + 8);
+    }
+
+    for (Node *n = fn->node; n; n = n->next)
+        gen(n);
+
+    // epilogue
+    emit(".L.return.%s:\n", funcname);
+    if (time_functions) {
+        emit("  mov rdi, rax\n");
+        emit("  rdtsc\n");
+        emit("  shl rdx, 32\n");
+        emit("  or rax, rdx\n");
+        emit("  sub rax, [rbp-%d]\n", fn->stack_size + 8);
+        emit("  inc qword ptr [rip + .L.time.%s]\n", funcname);
+        emit("  add [rip + .L.time.%s + 8], rax\n", funcname);
+        emit("  mov rax, rdi\n");
+    }
+    restore_regs(fn);
+    emit("  mov rsp, rbp\n");
+    emit("  pop rbp\n");
+    emit("  ret\n");
+
+    emit_cold_blocks();
 }
 
 static void emit_text(Program *prog) {
-    for (Function *fn = prog->fns; fn; fn = fn->next) {
-        printf(".global %s\n", fn->name);
-        printf("%s:\n", fn->name);
-        funcname = fn->name;
+    emit(".text\n");
 
-        // prologue
-        printf("  push rbp\n");
-        printf("  mov rbp, rsp\n");
-        printf("  sub rsp, %d\n", fn->stack_size);
+    int n = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+        n++;
+    Function **fns = calloc(n, sizeof(Function *));
+    n = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+        fns[n++] = fn;
+    if (has_profile())
+        qsort(fns, n, sizeof(Function *), cmp_hotness);
 
-        int i = 0;
-        for (VarList *vl = fn->params; vl; vl = vl->next) {
-            load_arg(vl->var, i++);
-        }
+    for (int i = 0; i < n; i++)
+        emit_function(fns[i]);
+    free(fns);
+}
 
-        for (Node *n = fn->node; n; n = n->next)
-            gen(n);
+// カウンタと、終了時にそれをファイルへ書き出す関数
+static void emit_profile_dumper() {
+    emit(".data\n");
+    emit("  .align 8\n");
+    emit(".L.prof:\n");
+    emit("  .quad %d\n", num_counters);
+    emit("  .zero %d\n", num_counters * 8);
 
-        // epilogue
-        printf(".L.return.%s:\n", funcname);
-        printf("  mov rsp, rbp\n");
-        printf("  pop rbp\n");
-        printf("  ret\n");
+    emit(".section .rodata\n");
+    emit(".L.prof.path:\n");
+    emit_string(profile_generate, strlen(profile_generate) + 1);
+    emit(".L.prof.mode:\n");
+    emit_string("wb", 3);
 
+    emit(".text\n");
+    emit(".L.prof.dump:\n");
+    emit("  push rbp\n");
+    emit("  mov rbp, rsp\n");
+    emit("  push rbx\n");
+    emit("  sub rsp, 8\n");
+    emit("  lea rdi, [rip + .L.prof.path]\n");
+    emit("  lea rsi, [rip + .L.prof.mode]\n");
+    emit("  call fopen\n");
+    emit("  test rax, rax\n");
+    emit("  je .L.prof.dump.end\n");
+    emit("  mov rbx, rax\n");
+    emit("  lea rdi, [rip + .L.prof]\n");
+    emit("  mov rsi, 8\n");
+    emit("  mov rdx, %d\n", num_counters + 1);
+    emit("  mov rcx, rbx\n");
+    emit("  call fwrite\n");
+    emit("  mov rdi, rbx\n");
+    emit("  call fclose\n");
+    emit(".L.prof.dump.end:\n");
+    emit("  mov rbx, [rbp-8]\n");
+    emit("  mov rsp, rbp\n");
+    emit("  pop rbp\n");
+    emit("  ret\n");
+
+    emit(".section .fini_array\n");
+    emit("  .align 8\n");
+    emit("  .quad .L.prof.dump\n");
+}
+
+// 関数ごとの呼び出し回数とサイクル数の表と、終了時にそれを
+// 標準エラー出力へ書き出す関数
+static void emit_timing_dumper(Program *prog) {
+    emit(".data\n");
+    emit("  .align 8\n");
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        emit(".L.time.%s:\n", fn->name);
+        emit("  .zero 16\n");
     }
+
+    emit(".section .rodata\n");
+    emit(".L.time.fmt:\n");
+    char *fmt = "%-16s %12ld calls %16ld cycles\n";
+    emit_string(fmt, strlen(fmt) + 1);
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        emit(".L.time.name.%s:\n", fn->name);
+        emit_string(fn->name, strlen(fn->name) + 1);
+    }
+
+    emit(".text\n");
+    emit(".L.time.dump:\n");
+    emit("  push rbp\n");
+    emit("  mov rbp, rsp\n");
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        emit("  mov rdi, 2\n");
+        emit("  lea rsi, [rip + .L.time.fmt]\n");
+        emit("  lea rdx, [rip + .L.time.name.%s]\n", fn->name);
+        emit("  mov rcx, [rip + .L.time.%s]\n", fn->name);
+        emit("  mov r8, [rip + .L.time.%s + 8]\n", fn->name);
+        emit("  mov rax, 0\n");
+        emit("  call dprintf\n");
+    }
+    emit("  mov rsp, rbp\n");
+    emit("  pop rbp\n");
+    emit("  ret\n");
+
+    emit(".section .fini_array\n");
+    emit("  .align 8\n");
+    emit("  .quad .L.time.dump\n");
 }
 
-void codegen(Program *prog) {
-    printf(".intel_syntax noprefix\n");
+void codegen(Program *prog, FILE *out) {
+    output_file = out;
+    labelseq = 1;
+    cold_blocks = NULL;
+    emit(".intel_syntax noprefix\n");
     emit_data(prog);
     emit_text(prog);
+    if (profile_generate)
+        emit_profile_dumper();
+    if (time_functions)
+        emit_timing_dumper(prog);
 }
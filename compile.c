@@ -0,0 +1,175 @@
+#include "9cc.h"
+
+// コンパイラをライブラリとして使うための入口。
+//
+// 状態は全てスレッドごとに持つので、別々のスレッドでなら compile を
+// 同時に呼べる。ノードや型などコンパイル中に作るものはアリーナから取り、
+// compile から戻るときにまとめて返す。エラーは終了せずに
+// Context の error で返す。
+
+// アリーナ。一つ目の塊は次のコンパイルでも使い回す
+#define CHUNK_SIZE (1 << 20)
+
+typedef struct Chunk Chunk;
+
+struct Chunk {
+    Chunk *next;
+    size_t cap;
+    size_t used;
+    char buf[];
+};
+
+static _Thread_local Chunk *arena;
+
+// 0 で埋めた領域を返す
+void *arena_alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!arena || arena->used + size > arena->cap) {
+        size_t cap = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+        Chunk *c = malloc(sizeof(Chunk) + cap);
+        if (!c)
+            error("メモリが足りません");
+        c->next = arena;
+        c->cap = cap;
+        c->used = 0;
+        arena = c;
+    }
+    void *p = arena->buf + arena->used;
+    arena->used += size;
+    return memset(p, 0, size);
+}
+
+char *arena_strndup(char *p, size_t len) {
+    len = strnlen(p, len);
+    char *s = arena_alloc(len + 1);
+    memcpy(s, p, len);
+    return s;
+}
+
+static void arena_reset() {
+    while (arena && arena->next) {
+        Chunk *c = arena;
+        arena = c->next;
+        free(c);
+    }
+    if (arena)
+        arena->used = 0;
+}
+
+void init_context(Context *ctx) {
+    *ctx = (Context){0};
+    ctx->filename = "-";
+    ctx->opt_level = 2;
+    ctx->unroll_factor = 4;
+}
+
+// コマンドラインのオプションを一つ ctx に反映する。
+// 成功すれば NULL、そうでなければエラーメッセージを返す
+char *parse_option(Context *ctx, char *arg) {
+    static _Thread_local char msg[256];
+    *msg = '\0';
+
+    if (!strncmp(arg, "--unroll=", 9)) {
+        ctx->unroll_factor = atoi(arg + 9);
+        if (ctx->unroll_factor < 1)
+            return "--unroll には 1 以上を指定してください";
+        return NULL;
+    }
+    if (!strcmp(arg, "--vectorize")) {
+        set_pass(ctx, "vectorize", true);
+        return NULL;
+    }
+    if (!strncmp(arg, "-O", 2)) {
+        char *level = arg + 2;
+        if (!*level)
+            ctx->opt_level = 1;
+        else if (strlen(level) == 1 && '0' <= *level && *level <= '3')
+            ctx->opt_level = *level - '0';
+        else
+            snprintf(msg, sizeof(msg), "不明な最適化レベルです: %s", arg);
+        return *msg ? msg : NULL;
+    }
+    if (!strncmp(arg, "-f", 2)) {
+        bool enable = strncmp(arg, "-fno-", 5) != 0;
+        if (!set_pass(ctx, arg + (enable ? 2 : 5), enable))
+            snprintf(msg, sizeof(msg), "不明なパスです: %s", arg);
+        return *msg ? msg : NULL;
+    }
+    if (!strcmp(arg, "--time-passes")) {
+        ctx->time_passes = true;
+        return NULL;
+    }
+    if (!strcmp(arg, "--time-functions")) {
+        ctx->time_functions = true;
+        return NULL;
+    }
+    if (!strncmp(arg, "--profile-generate=", 19)) {
+        ctx->profile_generate = arg + 19;
+        return NULL;
+    }
+    if (!strncmp(arg, "--profile-use=", 14)) {
+        ctx->profile_use = arg + 14;
+        return NULL;
+    }
+    snprintf(msg, sizeof(msg), "不明なオプションです: %s", arg);
+    return msg;
+}
+
+static int align_to(int n, int align) {
+    return (n + align -1) & ~(align -1);
+}
+
+static void assign_offsets(Program *prog) {
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        // フレームの先頭に callee-saved レジスタを退避する
+        int offset = fn->nregs * 8;
+        for(VarList *vl = fn->locals; vl; vl = vl->next) {
+            Var *var = vl->var;
+            if (var->reg)
+                continue;
+            offset = align_to(offset + var->ty->size, var->ty->align);
+            var->offset = offset;
+        }
+        fn->stack_size = align_to(offset, 8);
+    }
+}
+
+// source をコンパイルしてアセンブリを out に書く。
+// 成功すれば 0、失敗すれば ctx->error にメッセージを入れて -1 を返す
+int compile(Context *ctx, char *source, FILE *out) {
+    jmp_buf jmp;
+    ctx->error = NULL;
+    if (setjmp(jmp)) {
+        error_jmp = NULL;
+        ctx->error = error_msg;
+        arena_reset();
+        return -1;
+    }
+    error_jmp = &jmp;
+
+    filename = ctx->filename;
+    unroll_factor = ctx->unroll_factor;
+    time_functions = ctx->time_functions;
+    profile_generate = ctx->profile_generate;
+    profile_use = ctx->profile_use;
+
+    // エラーの表示は行が改行で終わることを前提にしている
+    int len = strlen(source);
+    if (len == 0 || source[len - 1] != '\n') {
+        char *s = arena_alloc(len + 2 + 16);
+        memcpy(s, source, len);
+        s[len] = '\n';
+        source = s;
+    }
+
+    token = tokenize(source);
+    Program *prog = program();
+    run_passes(prog, ctx);
+    assign_offsets(prog);
+    assign_counters(prog);
+    codegen(prog, out);
+
+    error_jmp = NULL;
+    arena_reset();
+    return 0;
+}
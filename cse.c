@@ -0,0 +1,380 @@
+#include "9cc.h"
+
+// 基本ブロック内の共通部分式の削除 (局所的な値番号付け)。
+//
+// 分岐を挟まずに続く文の並びを一つの単位とし、その中の式の各ノードに
+// 値番号を付ける。同じ演算子を同じ値番号の式に適用したものは同じ値に
+// なるので、二度目以降はそれを覚えておいた一時変数で置き換える。
+// 最初に現れたところは一時変数への代入に書き換える。
+//
+// 値が変わりうるものは毎回新しい番号にする。
+// 変数で同じ番号を与えるのは、アドレスを取られないスカラのローカル変数と
+// 配列 (アドレスが変わらない) だけ。ローカル変数への代入があると
+// その変数の番号を振り直す。メモリからの読み出しと関数呼び出しは
+// 毎回新しい番号になる。
+//
+// && と || の右辺は評価されないことがあるので、そこに現れた式は
+// 置き換えの元にも先にもしない。右辺の中の代入で変数の番号は振り直す。
+
+// ポインタをキーにする小さなハッシュ表
+typedef struct {
+    void **keys;
+    int *vals;
+    int cap;
+    int used;
+} Map;
+
+static int map_get(Map *map, void *key) {
+    if (!map->cap)
+        return 0;
+    for (int i = ((uintptr_t)key >> 3) & (map->cap - 1);; i = (i + 1) & (map->cap - 1)) {
+        if (map->keys[i] == key)
+            return map->vals[i];
+        if (!map->keys[i])
+            return 0;
+    }
+}
+
+static void map_put(Map *map, void *key, int val);
+
+static void map_grow(Map *map) {
+    Map old = *map;
+    map->cap = old.cap ? old.cap * 2 : 64;
+    map->keys = calloc(map->cap, sizeof(void *));
+    map->vals = calloc(map->cap, sizeof(int));
+    map->used = 0;
+    for (int i = 0; i < old.cap; i++)
+        if (old.keys[i])
+            map_put(map, old.keys[i], old.vals[i]);
+    free(old.keys);
+    free(old.vals);
+}
+
+static void map_put(Map *map, void *key, int val) {
+    if ((map->used + 1) * 2 > map->cap)
+        map_grow(map);
+    int i = ((uintptr_t)key >> 3) & (map->cap - 1);
+    while (map->keys[i] && map->keys[i] != key)
+        i = (i + 1) & (map->cap - 1);
+    if (!map->keys[i])
+        map->used++;
+    map->keys[i] = key;
+    map->vals[i] = val;
+}
+
+static void map_clear(Map *map) {
+    free(map->keys);
+    free(map->vals);
+    *map = (Map){0};
+}
+
+// 値番号の表。(種別, 左の番号, 右の番号) か定数・変数から番号を引く
+typedef struct Expr Expr;
+
+struct Expr {
+    Expr *next;
+    NodeKind kind;
+    long a;
+    long b;
+    int vn;
+};
+
+#define EXPR_HASH 256
+
+static _Thread_local Expr *exprs[EXPR_HASH];
+static _Thread_local int num_values;
+
+static _Thread_local Map node_vn;   // Node * -> 値番号
+static _Thread_local Map var_ver;   // Var * -> 代入された回数
+static _Thread_local Map first_vn;  // 値番号 -> 現れた回数
+static _Thread_local Map temps;     // 値番号 -> 一時変数の番号 (tempvars の添字 + 1)
+
+static _Thread_local Var **tempvars;
+static _Thread_local int num_temps;
+static _Thread_local Function *current_fn;
+
+static int lookup(NodeKind kind, long a, long b) {
+    unsigned h = (kind * 31 + a * 17 + b) & (EXPR_HASH - 1);
+    for (Expr *e = exprs[h]; e; e = e->next)
+        if (e->kind == kind && e->a == a && e->b == b)
+            return e->vn;
+
+    Expr *e = calloc(1, sizeof(Expr));
+    e->kind = kind;
+    e->a = a;
+    e->b = b;
+    e->vn = ++num_values;
+    e->next = exprs[h];
+    exprs[h] = e;
+    return e->vn;
+}
+
+static void reset() {
+    for (int i = 0; i < EXPR_HASH; i++) {
+        while (exprs[i]) {
+            Expr *e = exprs[i];
+            exprs[i] = e->next;
+            free(e);
+        }
+    }
+    map_clear(&node_vn);
+    map_clear(&var_ver);
+    map_clear(&first_vn);
+    map_clear(&temps);
+}
+
+static bool is_stable_var(Var *var) {
+    return var->ty->kind == TY_ARRAY ||
+        (var->is_local && !var->addr_taken);
+}
+
+static bool is_op(Node *node) {
+    switch (node->kind) {
+        case ND_ADD:
+        case ND_SUB:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+        case ND_PTR_ADD:
+        case ND_PTR_SUB:
+        case ND_PTR_DIFF:
+        case ND_MUL:
+        case ND_DIV:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// 一時変数を使うに値する式か。掛け算を含むか、二つ以上の演算からなる
+static bool is_candidate(Node *node) {
+    if (!is_op(node))
+        return false;
+    switch (node->kind) {
+        case ND_PTR_ADD:
+        case ND_PTR_SUB:
+        case ND_PTR_DIFF:
+        case ND_MUL:
+        case ND_DIV:
+            return true;
+        default:
+            return is_op(node->lhs) || is_op(node->rhs);
+    }
+}
+
+// 1: 評価順に値番号を付ける
+static int number(Node *node) {
+    int vn;
+    switch (node->kind) {
+        case ND_NUM:
+            vn = lookup(ND_NUM, node->val, 0);
+            break;
+        case ND_VAR:
+            if (is_stable_var(node->var))
+                vn = lookup(ND_VAR, (long)node->var, map_get(&var_ver, node->var));
+            else
+                vn = ++num_values;
+            break;
+        case ND_ADDR:
+        case ND_NOT:
+            vn = lookup(node->kind, number(node->lhs), 0);
+            break;
+        case ND_DEREF:
+            number(node->lhs);
+            vn = ++num_values;
+            break;
+        case ND_ASSIGN: {
+            if (node->lhs->kind != ND_VAR)
+                number(node->lhs);
+            number(node->rhs);
+            Var *var = node->lhs->kind == ND_VAR ? node->lhs->var : NULL;
+            if (var)
+                map_put(&var_ver, var, map_get(&var_ver, var) + 1);
+            vn = ++num_values;
+            break;
+        }
+        case ND_FUNCALL:
+            for (Node *arg = node->args; arg; arg = arg->next)
+                number(arg);
+            vn = ++num_values;
+            break;
+        default:
+            vn = lookup(node->kind, number(node->lhs), number(node->rhs));
+            break;
+    }
+    map_put(&node_vn, node, vn);
+    return vn;
+}
+
+static void visit_children(Node *node, void (*fn)(Node **));
+
+// 2: 上から見て、一度現れた式の二度目以降を数える。
+// 二度目以降の中身は丸ごと置き換わるので数えない
+static void mark(Node **p) {
+    Node *node = *p;
+    if (is_candidate(node)) {
+        int vn = map_get(&node_vn, node);
+        int n = map_get(&first_vn, (void *)(long)vn);
+        map_put(&first_vn, (void *)(long)vn, n + 1);
+        if (n)
+            return;
+    }
+    visit_children(node, mark);
+}
+
+// 3: 最初に現れたところを一時変数への代入に、以降を一時変数に置き換える
+static void rewrite(Node **p) {
+    Node *node = *p;
+    int vn = is_candidate(node) ? map_get(&node_vn, node) : 0;
+    if (!vn || map_get(&first_vn, (void *)(long)vn) < 2) {
+        visit_children(node, rewrite);
+        return;
+    }
+
+    // 配列に整数を足した式は配列の型を持つが、値は先頭のアドレス
+    Type *ty = node->ty;
+    if (ty->kind == TY_ARRAY)
+        ty = pointer_to(ty->base);
+
+    int t = map_get(&temps, (void *)(long)vn);
+    if (t) {
+        Node *var = new_var_node(tempvars[t - 1], node->loc);
+        var->ty = ty;
+        var->next = node->next;
+        *p = var;
+        return;
+    }
+
+    Var *tmp = arena_alloc(sizeof(Var));
+    tmp->name = ".cse";
+    tmp->ty = ty;
+    tmp->is_local = true;
+    tmp->is_temp = true;
+
+    VarList *vl = arena_alloc(sizeof(VarList));
+    vl->var = tmp;
+    vl->next = current_fn->locals;
+    current_fn->locals = vl;
+
+    tempvars = realloc(tempvars, sizeof(Var *) * (num_temps + 1));
+    tempvars[num_temps++] = tmp;
+    map_put(&temps, (void *)(long)vn, num_temps);
+
+    Node *copy = copy_node(node);
+    copy->next = NULL;
+    visit_children(copy, rewrite);
+
+    Node *lhs = new_var_node(tmp, node->loc);
+    lhs->ty = ty;
+    node->kind = ND_ASSIGN;
+    node->ty = ty;
+    node->lhs = lhs;
+    node->rhs = copy;
+}
+
+static void visit_children(Node *node, void (*fn)(Node **)) {
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_VAR:
+            return;
+        case ND_ADDR:
+        case ND_DEREF:
+        case ND_NOT:
+        case ND_LOGAND:
+        case ND_LOGOR:
+            fn(&node->lhs);
+            return;
+        case ND_ASSIGN:
+            if (node->lhs->kind != ND_VAR)
+                fn(&node->lhs);
+            fn(&node->rhs);
+            return;
+        case ND_FUNCALL:
+            for (Node **arg = &node->args; *arg; arg = &(*arg)->next)
+                fn(arg);
+            return;
+        default:
+            fn(&node->lhs);
+            fn(&node->rhs);
+            return;
+    }
+}
+
+// 分岐を挟まない式の並び
+static _Thread_local Node ***run;
+static _Thread_local int run_len;
+
+static void add_to_run(Node **p) {
+    run = realloc(run, sizeof(Node **) * (run_len + 1));
+    run[run_len++] = p;
+}
+
+static void flush_run() {
+    for (int i = 0; i < run_len; i++)
+        number(*run[i]);
+    for (int i = 0; i < run_len; i++)
+        mark(run[i]);
+    for (int i = 0; i < run_len; i++)
+        rewrite(run[i]);
+    run_len = 0;
+    reset();
+}
+
+// 文の並びを分岐のところで区切りながら見ていく
+static void cse_stmts(Node *node) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+            case ND_EXPR_STMT:
+                add_to_run(&node->lhs);
+                break;
+            case ND_RETURN:
+                add_to_run(&node->lhs);
+                flush_run();
+                break;
+            case ND_IF:
+                add_to_run(&node->cond);
+                flush_run();
+                cse_stmts(node->then);
+                cse_stmts(node->els);
+                break;
+            case ND_WHILE:
+            case ND_FOR:
+                if (node->init)
+                    add_to_run(&node->init->lhs);
+                flush_run();
+                cse_stmts(node->then);
+                break;
+            case ND_SWITCH:
+                add_to_run(&node->cond);
+                flush_run();
+                cse_stmts(node->then);
+                break;
+            case ND_CASE:
+                // 他の場所から飛んでくるので、ここで区切る
+                flush_run();
+                cse_stmts(node->then);
+                break;
+            case ND_BREAK:
+                flush_run();
+                break;
+            case ND_BLOCK:
+                flush_run();
+                cse_stmts(node->body);
+                break;
+            default:
+                break;
+        }
+    }
+    flush_run();
+}
+
+// 作った一時変数の数を返す
+int eliminate_common_subexprs(Program *prog) {
+    num_temps = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        current_fn = fn;
+        cse_stmts(fn->node);
+    }
+    return num_temps;
+}
@@ -0,0 +1,399 @@
+#include "9cc.h"
+
+// ループの誘導変数の強さの軽減。
+//
+//   for (init; i < n; i = i + c) ... a[i] ...
+//
+// のように、ループの中で i が i = i + c (c は定数) でしか変わらない
+// for ループで、a[i] のアドレス a + i*size を毎回計算する代わりに
+// ポインタ p = a + i をループの前で一度求め、i を進めるたびに
+// p にも c*size を足す。a は配列か、ループの中で代入されない
+// ローカルのポインタ変数に限る。
+//
+// i がループの外で使われず、ループの中でも添字と条件にしか
+// 使われないときは、条件を p < a + n に置き換え (LFTR)、
+// i を進めるのもやめる。
+
+// 一つのループで作るポインタの数の上限
+#define MAX_IVS 4
+
+typedef struct {
+    Var *base;
+    Type *ty; // a + i の型
+    Var *ptr;
+} IV;
+
+static _Thread_local Var *iv;            // 誘導変数 i
+static _Thread_local IV ivs[MAX_IVS];
+static _Thread_local int num_ivs;
+static _Thread_local Function *current_fn;
+static _Thread_local int num_reduced;
+
+// 木の全てのノードへのポインタを行きがけ順に fn へ渡す
+static void walk(Node **p, void (*fn)(Node **)) {
+    for (; *p; p = &(*p)->next) {
+        Node *node = *p;
+        fn(p);
+        node = *p;
+        switch (node->kind) {
+            case ND_NUM:
+            case ND_VAR:
+            case ND_NULL:
+            case ND_BREAK:
+                break;
+            case ND_IF:
+            case ND_WHILE:
+            case ND_FOR:
+            case ND_SWITCH:
+            case ND_CASE:
+                walk(&node->init, fn);
+                walk(&node->cond, fn);
+                walk(&node->then, fn);
+                walk(&node->els, fn);
+                walk(&node->inc, fn);
+                break;
+            case ND_BLOCK:
+                walk(&node->body, fn);
+                break;
+            case ND_FUNCALL:
+                walk(&node->args, fn);
+                break;
+            default:
+                walk(&node->lhs, fn);
+                walk(&node->rhs, fn);
+                break;
+        }
+    }
+}
+
+// 一つのノードだけを walk する
+static void walk1(Node **p, void (*fn)(Node **)) {
+    if (!*p)
+        return;
+    Node *next = (*p)->next;
+    (*p)->next = NULL;
+    walk(p, fn);
+    (*p)->next = next;
+}
+
+static _Thread_local int refs;
+static _Thread_local int assigns;
+static _Thread_local Var *target;
+
+static void count_refs(Node **p) {
+    if ((*p)->kind == ND_VAR && (*p)->var == target)
+        refs++;
+}
+
+static void count_assigns(Node **p) {
+    Node *node = *p;
+    if (node->kind == ND_ASSIGN && node->lhs->kind == ND_VAR &&
+            node->lhs->var == target)
+        assigns++;
+}
+
+// ループの条件、本体、増分の中で var を数える
+static int count_in_loop(Node *loop, Var *var, void (*fn)(Node **)) {
+    target = var;
+    refs = assigns = 0;
+    walk1(&loop->cond, fn);
+    walk1(&loop->then, fn);
+    walk1(&loop->inc, fn);
+    return fn == count_refs ? refs : assigns;
+}
+
+// i = i + c なら c、そうでなければ 0
+static long increment(Node *stmt) {
+    if (!stmt || stmt->kind != ND_EXPR_STMT || stmt->lhs->kind != ND_ASSIGN)
+        return 0;
+    Node *assign = stmt->lhs;
+    Node *add = assign->rhs;
+    if (assign->lhs->kind == ND_VAR && assign->lhs->var == iv &&
+            add->kind == ND_ADD && add->lhs->kind == ND_VAR &&
+            add->lhs->var == iv && add->rhs->kind == ND_NUM)
+        return add->rhs->val;
+    return 0;
+}
+
+static _Thread_local bool has_case;
+
+static void find_case(Node **p) {
+    if ((*p)->kind == ND_CASE)
+        has_case = true;
+}
+
+// 本体の一番外側の文の並び
+static Node **top_stmts(Node *loop) {
+    if (loop->then->kind == ND_BLOCK)
+        return &loop->then->body;
+    return &loop->then;
+}
+
+static bool is_invariant_base(Var *var, Node *loop) {
+    if (var->ty->kind == TY_ARRAY)
+        return true;
+    return var->is_local && !var->addr_taken &&
+        count_in_loop(loop, var, count_assigns) == 0;
+}
+
+static _Thread_local Node *loop_node;
+
+static void find_ivs(Node **p) {
+    Node *node = *p;
+    if (node->kind != ND_PTR_ADD || node->rhs->kind != ND_VAR ||
+            node->rhs->var != iv || node->lhs->kind != ND_VAR)
+        return;
+
+    Var *base = node->lhs->var;
+    for (int k = 0; k < num_ivs; k++)
+        if (ivs[k].base == base)
+            return;
+    if (num_ivs == MAX_IVS || !is_invariant_base(base, loop_node))
+        return;
+    ivs[num_ivs].base = base;
+    ivs[num_ivs].ty = node->ty;
+    num_ivs++;
+}
+
+static IV *find_iv(Node *node) {
+    if (node->kind != ND_PTR_ADD || node->rhs->kind != ND_VAR ||
+            node->rhs->var != iv || node->lhs->kind != ND_VAR)
+        return NULL;
+    for (int k = 0; k < num_ivs; k++)
+        if (ivs[k].base == node->lhs->var)
+            return &ivs[k];
+    return NULL;
+}
+
+static void replace_ivs(Node **p) {
+    IV *v = find_iv(*p);
+    if (!v)
+        return;
+    Node *var = new_var_node(v->ptr, (*p)->loc);
+    add_type(var);
+    var->next = (*p)->next;
+    *p = var;
+    v->base->refcnt--;
+    iv->refcnt--;
+}
+
+static Var *new_temp(Type *ty) {
+    Var *var = arena_alloc(sizeof(Var));
+    var->name = ".iv";
+    var->ty = ty;
+    var->is_local = true;
+    var->is_temp = true;
+
+    VarList *vl = arena_alloc(sizeof(VarList));
+    vl->var = var;
+    vl->next = current_fn->locals;
+    current_fn->locals = vl;
+    return var;
+}
+
+static Node *new_assign(Var *var, Node *rhs, char *loc) {
+    Node *node = new_binary(ND_ASSIGN, new_var_node(var, loc), rhs, loc);
+    add_type(node);
+    return new_unary(ND_EXPR_STMT, node, loc);
+}
+
+// p = p + c*size を並べたもの
+static Node *advance_ptrs(long c, char *loc) {
+    Node head = {};
+    Node *cur = &head;
+    for (int k = 0; k < num_ivs; k++) {
+        Var *ptr = ivs[k].ptr;
+        Node *var = new_var_node(ptr, loc);
+        add_type(var);
+        Node *num = new_num(c * ptr->ty->base->size, loc);
+        add_type(num);
+        Node *add = new_binary(ND_ADD, var, num, loc);
+        add->ty = ptr->ty;
+        cur = cur->next = new_assign(ptr, add, loc);
+    }
+    return head.next;
+}
+
+static Node *last(Node *node) {
+    while (node->next)
+        node = node->next;
+    return node;
+}
+
+// 条件の左辺の i か i + k (展開したループの条件) から i を取り出す
+static Var *cond_var(Node *lhs) {
+    if (lhs->kind == ND_ADD && lhs->rhs->kind == ND_NUM)
+        lhs = lhs->lhs;
+    if (lhs->kind != ND_VAR)
+        return NULL;
+    return lhs->var;
+}
+
+static Node *reduce(Node *loop) {
+    Node *cond = loop->cond;
+    if (loop->vec || !cond || (cond->kind != ND_LT && cond->kind != ND_LE))
+        return NULL;
+    iv = cond_var(cond->lhs);
+    if (!iv || !iv->is_local || iv->addr_taken || iv->ty->kind != TY_INT)
+        return NULL;
+
+    // 本体の中の case へは外の switch から前置きを飛ばして入ってくる
+    has_case = false;
+    walk1(&loop->then, find_case);
+    if (has_case)
+        return NULL;
+
+    Node *n = cond->rhs;
+    bool n_invariant = cond->lhs->kind == ND_VAR && (n->kind == ND_NUM ||
+        (n->kind == ND_VAR && n->var != iv && n->var->is_local &&
+         !n->var->addr_taken && n->var->ty->kind != TY_ARRAY &&
+         count_in_loop(loop, n->var, count_assigns) == 0));
+
+    // i への代入は増分と本体の一番外側の i = i + c だけ
+    long inc_step = increment(loop->inc);
+    if (!inc_step)
+        return NULL;
+    int allowed = 1;
+    for (Node *s = *top_stmts(loop); s; s = s->next)
+        if (increment(s))
+            allowed++;
+    if (count_in_loop(loop, iv, count_assigns) != allowed)
+        return NULL;
+
+    num_ivs = 0;
+    loop_node = loop;
+    walk1(&loop->cond, find_ivs);
+    walk1(&loop->then, find_ivs);
+    if (num_ivs == 0)
+        return NULL;
+
+    char *loc = loop->loc;
+    for (int k = 0; k < num_ivs; k++)
+        ivs[k].ptr = new_temp(ivs[k].ty->kind == TY_ARRAY ?
+                              pointer_to(ivs[k].ty->base) : ivs[k].ty);
+
+    // i を使う場所の数。置き換えの前に数える
+    target = iv;
+    refs = 0;
+    walk(&current_fn->node, count_refs);
+    int refs_total = refs;
+    refs = 0;
+    walk1(&loop->init, count_refs);
+    int refs_init = refs;
+    int refs_loop = count_in_loop(loop, iv, count_refs);
+
+    walk1(&loop->cond, replace_ivs);
+    walk1(&loop->then, replace_ivs);
+
+    // 本体の中の i = i + c の後ろでポインタも進める
+    for (Node *s = *top_stmts(loop); s; s = s->next) {
+        long c = increment(s);
+        if (!c)
+            continue;
+        Node *adv = advance_ptrs(c, s->loc);
+        Node *end = last(adv);
+        end->next = s->next;
+        s->next = adv;
+        s = end;
+    }
+
+    // 増分はブロックにしてポインタの分を足す
+    Node *inc = new_node(ND_BLOCK, loop->inc->loc);
+    inc->body = loop->inc;
+    loop->inc->next = advance_ptrs(inc_step, loc);
+    loop->inc = inc;
+
+    // 前置き: init; p = a + i; ...
+    Node head = {};
+    Node *cur = &head;
+    if (loop->init) {
+        cur = cur->next = loop->init;
+        loop->init = NULL;
+    }
+    for (int k = 0; k < num_ivs; k++) {
+        Node *base = new_var_node(ivs[k].base, loc);
+        Node *idx = new_var_node(iv, loc);
+        Node *addr = new_binary(ND_PTR_ADD, base, idx, loc);
+        add_type(addr);
+        cur = cur->next = new_assign(ivs[k].ptr, addr, loc);
+    }
+
+    // i がループの外で使われず、ループの中でも条件と増分にしか
+    // 残らないなら、条件を p < a + n にする
+    if (n_invariant && refs_total == refs_init + refs_loop &&
+            count_in_loop(loop, iv, count_refs) == 1 + 2 * allowed) {
+        Var *end = new_temp(ivs[0].ptr->ty);
+        // n は古い条件から移すだけなので参照の数は変わらない
+        Node *addr = new_binary(ND_PTR_ADD, new_var_node(ivs[0].base, loc),
+                                copy_node(n), loc);
+        add_type(addr);
+        cur = cur->next = new_assign(end, addr, loc);
+
+        Node *lhs = new_var_node(ivs[0].ptr, loc);
+        Node *rhs = new_var_node(end, loc);
+        loop->cond = new_binary(cond->kind, lhs, rhs, cond->loc);
+        add_type(loop->cond);
+        iv->refcnt--;
+
+        // i を進める文を取り除く
+        for (Node **s = top_stmts(loop); *s;) {
+            if (increment(*s))
+                *s = (*s)->next;
+            else
+                s = &(*s)->next;
+        }
+        loop->inc->body = loop->inc->body->next;
+        iv->refcnt -= 2 * allowed;
+    }
+
+    cur->next = loop;
+    Node *block = new_node(ND_BLOCK, loc);
+    block->body = head.next;
+    return block;
+}
+
+static void reduce_stmts(Node **p) {
+    for (; *p; p = &(*p)->next) {
+        Node *node = *p;
+        switch (node->kind) {
+            case ND_IF:
+                reduce_stmts(&node->then);
+                reduce_stmts(&node->els);
+                break;
+            case ND_WHILE:
+            case ND_SWITCH:
+            case ND_CASE:
+                reduce_stmts(&node->then);
+                break;
+            case ND_FOR: {
+                reduce_stmts(&node->then);
+                Node *next = node->next;
+                node->next = NULL;
+                Node *block = reduce(node);
+                if (block) {
+                    num_reduced++;
+                    block->next = next;
+                    *p = block;
+                } else {
+                    node->next = next;
+                }
+                break;
+            }
+            case ND_BLOCK:
+                reduce_stmts(&node->body);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// 書き換えたループの数を返す
+int reduce_induction_vars(Program *prog) {
+    num_reduced = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        current_fn = fn;
+        reduce_stmts(&fn->node);
+    }
+    return num_reduced;
+}
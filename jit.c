@@ -0,0 +1,985 @@
+#include "9cc.h"
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// --run で使う、codegen が出力するアセンブリをその場で機械語にして
+// 実行するための小さなアセンブラ。codegen が使う命令と疑似命令だけを
+// 扱う。外部の関数は dlsym で libc から探す。
+//
+// 全体を MAP_32BIT で下位 2GB に置くので、絶対アドレスは
+// push offset sym のように 32 ビットの即値で表せる。
+
+typedef enum {
+    SEC_TEXT,
+    SEC_RODATA,
+    SEC_DATA,
+    SEC_BSS,
+    SEC_FINI, // .fini_array: main の後に呼ぶ関数
+    NUM_SECTIONS,
+} SectionKind;
+
+typedef struct {
+    unsigned char *buf;
+    long len;
+    long cap;
+    long addr; // 配置後の先頭アドレス
+} Section;
+
+typedef struct Symbol Symbol;
+
+struct Symbol {
+    Symbol *next;
+    char *name;
+    bool defined;
+    SectionKind sec;
+    long off;
+    Symbol *alias; // .set で別名にしたとき
+    long addend;
+    long stub; // 外部関数を呼ぶための中継コードの位置 (-1 はなし)
+};
+
+typedef enum {
+    FX_REL32, // S + A - 命令の終わり
+    FX_ABS32,
+    FX_ABS64,
+} FixupKind;
+
+typedef struct Fixup Fixup;
+
+struct Fixup {
+    Fixup *next;
+    FixupKind kind;
+    SectionKind sec;
+    long off;
+    long end; // FX_REL32 のときの命令の終わり
+    Symbol *sym;
+    long addend;
+};
+
+typedef enum {
+    OP_REG,
+    OP_IMM,
+    OP_MEM,
+    OP_SYM, // jmp や call の飛び先
+} OperandKind;
+
+#define REG_RIP 16
+#define REG_BYTE 0x100 // ModR/M の reg 欄が 8 ビットレジスタ
+
+typedef struct {
+    OperandKind kind;
+    int reg; // OP_REG
+    int size; // レジスタまたは "xxx ptr" の大きさ
+    long imm; // OP_IMM
+    char *sym; // OP_SYM, offset sym, メモリ中のシンボル
+    int base; // OP_MEM, -1 はなし
+    int index; // OP_MEM, -1 はなし
+    int scale;
+    long disp;
+} Operand;
+
+static Section sections[NUM_SECTIONS];
+static SectionKind cur_sec;
+static Symbol *symtab[4096];
+static Fixup *fixups;
+static Fixup *insn_fixups; // 今の命令で追加した fixup の先頭
+static int line_no;
+
+static void jit_error(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "jit: line %d: ", line_no);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+//
+// 出力
+//
+
+static void put(SectionKind sec, void *p, int n) {
+    Section *s = &sections[sec];
+    if (s->len + n > s->cap) {
+        s->cap = (s->len + n) * 2 + 256;
+        s->buf = realloc(s->buf, s->cap);
+    }
+    memcpy(s->buf + s->len, p, n);
+    s->len += n;
+}
+
+static void put1(int c) {
+    unsigned char b = c;
+    put(cur_sec, &b, 1);
+}
+
+static void put4(long v) {
+    int32_t x = v;
+    put(cur_sec, &x, 4);
+}
+
+static void put8(long v) {
+    put(cur_sec, &v, 8);
+}
+
+static Symbol *intern(char *name) {
+    unsigned h = 0;
+    for (char *p = name; *p; p++)
+        h = h * 31 + (unsigned char)*p;
+    Symbol **slot = &symtab[h % 4096];
+    for (Symbol *sym = *slot; sym; sym = sym->next)
+        if (!strcmp(sym->name, name))
+            return sym;
+
+    Symbol *sym = calloc(1, sizeof(Symbol));
+    sym->name = strdup(name);
+    sym->stub = -1;
+    sym->next = *slot;
+    *slot = sym;
+    return sym;
+}
+
+static void add_fixup(FixupKind kind, char *name, long addend) {
+    Fixup *fx = calloc(1, sizeof(Fixup));
+    fx->kind = kind;
+    fx->sec = cur_sec;
+    fx->off = sections[cur_sec].len;
+    fx->sym = intern(name);
+    fx->addend = addend;
+    fx->next = fixups;
+    fixups = fx;
+    if (!insn_fixups)
+        insn_fixups = fx;
+
+    if (kind == FX_ABS64)
+        put8(0);
+    else
+        put4(0);
+}
+
+//
+// 字句
+//
+
+static char *skip_blank(char *p) {
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+static bool is_symchar(char c) {
+    return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+static char *read_name(char **pp) {
+    char *p = skip_blank(*pp);
+    char *q = p;
+    while (is_symchar(*q))
+        q++;
+    *pp = q;
+    return strndup(p, q - p);
+}
+
+static long read_number(char **pp) {
+    char *p = skip_blank(*pp);
+    char *end;
+    long v = strtol(p, &end, 0);
+    if (end == p)
+        jit_error("数値がありません: %s", p);
+    *pp = end;
+    return v;
+}
+
+static struct {
+    char *name;
+    int reg;
+    int size;
+} regs[] = {
+    {"rax", 0, 8}, {"rcx", 1, 8}, {"rdx", 2, 8}, {"rbx", 3, 8},
+    {"rsp", 4, 8}, {"rbp", 5, 8}, {"rsi", 6, 8}, {"rdi", 7, 8},
+    {"r8", 8, 8}, {"r9", 9, 8}, {"r10", 10, 8}, {"r11", 11, 8},
+    {"r12", 12, 8}, {"r13", 13, 8}, {"r14", 14, 8}, {"r15", 15, 8},
+    {"al", 0, 1}, {"cl", 1, 1}, {"dl", 2, 1}, {"bl", 3, 1},
+    {"spl", 4, 1}, {"bpl", 5, 1}, {"sil", 6, 1}, {"dil", 7, 1},
+    {"r8b", 8, 1}, {"r9b", 9, 1}, {"r10b", 10, 1}, {"r11b", 11, 1},
+    {"r12b", 12, 1}, {"r13b", 13, 1}, {"r14b", 14, 1}, {"r15b", 15, 1},
+    {"xmm0", 0, 16}, {"xmm1", 1, 16}, {"xmm2", 2, 16}, {"xmm3", 3, 16},
+    {"xmm4", 4, 16}, {"xmm5", 5, 16}, {"xmm6", 6, 16}, {"xmm7", 7, 16},
+    {"xmm8", 8, 16}, {"xmm9", 9, 16}, {"xmm10", 10, 16}, {"xmm11", 11, 16},
+    {"xmm12", 12, 16}, {"xmm13", 13, 16}, {"xmm14", 14, 16}, {"xmm15", 15, 16},
+};
+
+static bool find_reg(char *name, int *reg, int *size) {
+    for (size_t i = 0; i < sizeof(regs) / sizeof(*regs); i++) {
+        if (!strcmp(regs[i].name, name)) {
+            *reg = regs[i].reg;
+            *size = regs[i].size;
+            return true;
+        }
+    }
+    return false;
+}
+
+// [base + index*scale + disp + sym]
+static void read_mem(char **pp, Operand *op) {
+    char *p = skip_blank(*pp) + 1;
+    op->kind = OP_MEM;
+    op->base = -1;
+    op->index = -1;
+    op->scale = 1;
+
+    int sign = 1;
+    for (;;) {
+        p = skip_blank(p);
+        if (*p == ']')
+            break;
+        if (*p == '+' || *p == '-') {
+            sign = (*p == '-') ? -1 : 1;
+            p++;
+            continue;
+        }
+        if (isdigit(*p)) {
+            op->disp += sign * read_number(&p);
+            continue;
+        }
+
+        char *name = read_name(&p);
+        int reg, size;
+        if (!strcmp(name, "rip")) {
+            op->base = REG_RIP;
+        } else if (find_reg(name, &reg, &size)) {
+            p = skip_blank(p);
+            if (*p == '*') {
+                p++;
+                op->index = reg;
+                op->scale = read_number(&p);
+            } else if (op->base == -1) {
+                op->base = reg;
+            } else {
+                op->index = reg;
+            }
+        } else if (*name) {
+            op->sym = name;
+        } else {
+            jit_error("メモリオペランドが読めません: %s", *pp);
+        }
+    }
+    *pp = p + 1;
+}
+
+static void read_operand(char **pp, Operand *op) {
+    char *p = skip_blank(*pp);
+    memset(op, 0, sizeof(*op));
+
+    if (*p == '[') {
+        read_mem(&p, op);
+        *pp = p;
+        return;
+    }
+
+    if (isdigit(*p) || *p == '-') {
+        op->kind = OP_IMM;
+        op->imm = read_number(&p);
+        *pp = p;
+        return;
+    }
+
+    char *name = read_name(&p);
+    if (!strcmp(name, "byte") || !strcmp(name, "qword") || !strcmp(name, "xmmword")) {
+        int size = name[0] == 'b' ? 1 : name[0] == 'q' ? 8 : 16;
+        char *ptr = read_name(&p);
+        if (strcmp(ptr, "ptr"))
+            jit_error("ptr がありません");
+        read_mem(&p, op);
+        op->size = size;
+        *pp = p;
+        return;
+    }
+    if (!strcmp(name, "offset")) {
+        op->kind = OP_IMM;
+        op->sym = read_name(&p);
+        *pp = p;
+        return;
+    }
+    if (find_reg(name, &op->reg, &op->size)) {
+        op->kind = OP_REG;
+        *pp = p;
+        return;
+    }
+    if (!*name)
+        jit_error("オペランドが読めません: %s", p);
+    op->kind = OP_SYM;
+    op->sym = name;
+    *pp = p;
+}
+
+//
+// 命令の符号化
+//
+
+static bool is_imm8(long v) {
+    return -128 <= v && v <= 127;
+}
+
+static bool is_imm32(long v) {
+    return INT32_MIN <= v && v <= INT32_MAX;
+}
+
+// REX プレフィックス、オペコード、ModR/M (と SIB, 変位) を出力する。
+// rm がレジスタのときは rm->reg を、メモリのときはアドレスを符号化する。
+static void encode(int prefix, bool w, char *opcode, int nopcode, int reg, Operand *rm) {
+    int rex = 0;
+    if ((reg & REG_BYTE) && (reg & 15) >= 4)
+        rex |= 0x40;
+    reg &= 15;
+    if (w)
+        rex |= 8;
+    if (reg & 8)
+        rex |= 4;
+    if (rm->kind == OP_REG) {
+        if (rm->reg & 8)
+            rex |= 1;
+        if (rm->size == 1 && rm->reg >= 4)
+            rex |= 0x40;
+    } else {
+        if (rm->index >= 0 && (rm->index & 8))
+            rex |= 2;
+        if (rm->base >= 0 && rm->base != REG_RIP && (rm->base & 8))
+            rex |= 1;
+    }
+
+    if (prefix)
+        put1(prefix);
+    if (rex)
+        put1(0x40 | rex);
+    for (int i = 0; i < nopcode; i++)
+        put1(opcode[i]);
+
+    int r = (reg & 7) << 3;
+
+    if (rm->kind == OP_REG) {
+        put1(0xc0 | r | (rm->reg & 7));
+        return;
+    }
+
+    // [rip + sym + disp]
+    if (rm->base == REG_RIP) {
+        put1(0x05 | r);
+        if (rm->sym) {
+            add_fixup(FX_REL32, rm->sym, rm->disp);
+        } else {
+            put4(rm->disp);
+        }
+        return;
+    }
+
+    // [sym + index*scale + disp] または [disp]
+    if (rm->base < 0) {
+        put1(0x04 | r);
+        int ss = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        int idx = rm->index >= 0 ? rm->index & 7 : 4;
+        put1((ss << 6) | (idx << 3) | 5);
+        if (rm->sym)
+            add_fixup(FX_ABS32, rm->sym, rm->disp);
+        else
+            put4(rm->disp);
+        return;
+    }
+
+    int mod;
+    if (rm->sym || !is_imm8(rm->disp))
+        mod = 2;
+    else if (rm->disp || (rm->base & 7) == 5)
+        mod = 1;
+    else
+        mod = 0;
+
+    if (rm->index >= 0 || (rm->base & 7) == 4) {
+        put1((mod << 6) | r | 4);
+        int ss = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        int idx = rm->index >= 0 ? rm->index & 7 : 4;
+        put1((ss << 6) | (idx << 3) | (rm->base & 7));
+    } else {
+        put1((mod << 6) | r | (rm->base & 7));
+    }
+
+    if (mod == 1)
+        put1(rm->disp);
+    else if (mod == 2 && rm->sym)
+        add_fixup(FX_ABS32, rm->sym, rm->disp);
+    else if (mod == 2)
+        put4(rm->disp);
+}
+
+static void encode1(int prefix, bool w, int opcode, int reg, Operand *rm) {
+    char op = opcode;
+    encode(prefix, w, &op, 1, reg, rm);
+}
+
+static void encode2(int prefix, bool w, int op1, int op2, int reg, Operand *rm) {
+    char op[] = {op1, op2};
+    encode(prefix, w, op, 2, reg, rm);
+}
+
+static void put_imm(Operand *op, bool imm8) {
+    if (op->sym)
+        add_fixup(FX_ABS32, op->sym, op->imm);
+    else if (imm8)
+        put1(op->imm);
+    else
+        put4(op->imm);
+}
+
+static void rel32(int op1, int op2, Operand *target) {
+    if (target->kind != OP_SYM)
+        jit_error("飛び先がありません");
+    if (op2 >= 0) {
+        put1(op1);
+        put1(op2);
+    } else {
+        put1(op1);
+    }
+    add_fixup(FX_REL32, target->sym, 0);
+}
+
+static char *cond_codes[] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a",
+    "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+static int cond_code(char *s) {
+    for (int i = 0; i < 16; i++)
+        if (!strcmp(cond_codes[i], s))
+            return i;
+    if (!strcmp(s, "z"))
+        return 4;
+    if (!strcmp(s, "nz"))
+        return 5;
+    return -1;
+}
+
+static int alu_code(char *mn) {
+    static char *alu[] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"};
+    for (int i = 0; i < 8; i++)
+        if (!strcmp(alu[i], mn))
+            return i;
+    return -1;
+}
+
+// SSE2 の整数演算 (66 0F xx /r)
+static struct {
+    char *name;
+    int opcode;
+} sse_ops[] = {
+    {"paddb", 0xfc}, {"paddq", 0xd4}, {"psubb", 0xf8}, {"psubq", 0xfb},
+    {"pxor", 0xef},
+};
+
+static int sse_code(char *mn) {
+    for (size_t i = 0; i < sizeof(sse_ops) / sizeof(*sse_ops); i++)
+        if (!strcmp(sse_ops[i].name, mn))
+            return sse_ops[i].opcode;
+    return -1;
+}
+
+static bool is_reg(Operand *op, int size) {
+    return op->kind == OP_REG && op->size == size;
+}
+
+static bool is_rm(Operand *op, int size) {
+    return is_reg(op, size) || (op->kind == OP_MEM && (op->size == 0 || op->size == size));
+}
+
+static void bad_operands(char *mn) {
+    jit_error("%s のオペランドに対応していません", mn);
+}
+
+static void assemble_insn(char *mn, Operand *ops, int nops) {
+    Operand *a = &ops[0];
+    Operand *b = &ops[1];
+    int n;
+
+    if (!strcmp(mn, "ret")) {
+        put1(0xc3);
+        return;
+    }
+    if (!strcmp(mn, "cqo")) {
+        put1(0x48);
+        put1(0x99);
+        return;
+    }
+    if (!strcmp(mn, "rdtsc")) {
+        put1(0x0f);
+        put1(0x31);
+        return;
+    }
+    if (!strcmp(mn, "nop")) {
+        put1(0x90);
+        return;
+    }
+
+    if (!strcmp(mn, "push")) {
+        if (a->kind == OP_REG) {
+            if (a->reg & 8)
+                put1(0x41);
+            put1(0x50 + (a->reg & 7));
+        } else if (a->kind == OP_IMM) {
+            if (!a->sym && !is_imm32(a->imm))
+                jit_error("即値が 32 ビットに収まりません: %ld", a->imm);
+            bool imm8 = !a->sym && is_imm8(a->imm);
+            put1(imm8 ? 0x6a : 0x68);
+            put_imm(a, imm8);
+        } else if (a->kind == OP_MEM) {
+            encode1(0, false, 0xff, 6, a);
+        } else {
+            bad_operands(mn);
+        }
+        return;
+    }
+
+    if (!strcmp(mn, "pop")) {
+        if (a->kind != OP_REG)
+            bad_operands(mn);
+        if (a->reg & 8)
+            put1(0x41);
+        put1(0x58 + (a->reg & 7));
+        return;
+    }
+
+    if (!strcmp(mn, "mov")) {
+        if (is_reg(b, 8) && is_rm(a, 8)) {
+            encode1(0, true, 0x89, b->reg, a);
+        } else if (is_reg(b, 1) && is_rm(a, 1)) {
+            encode1(0, false, 0x88, b->reg | REG_BYTE, a);
+        } else if (is_reg(a, 8) && b->kind == OP_MEM) {
+            encode1(0, true, 0x8b, a->reg, b);
+        } else if (is_reg(a, 1) && b->kind == OP_MEM) {
+            encode1(0, false, 0x8a, a->reg | REG_BYTE, b);
+        } else if (is_reg(a, 8) && b->kind == OP_IMM && !b->sym && !is_imm32(b->imm)) {
+            put1(0x48 | ((a->reg & 8) ? 1 : 0));
+            put1(0xb8 + (a->reg & 7));
+            put8(b->imm);
+        } else if (is_rm(a, 8) && b->kind == OP_IMM) {
+            encode1(0, true, 0xc7, 0, a);
+            put_imm(b, false);
+        } else {
+            bad_operands(mn);
+        }
+        return;
+    }
+
+    if (!strcmp(mn, "movdqu")) {
+        if (is_reg(a, 16) && is_rm(b, 16))
+            encode2(0xf3, false, 0x0f, 0x6f, a->reg, b);
+        else if (a->kind == OP_MEM && is_reg(b, 16))
+            encode2(0xf3, false, 0x0f, 0x7f, b->reg, a);
+        else
+            bad_operands(mn);
+        return;
+    }
+    if ((n = sse_code(mn)) >= 0) {
+        if (!is_reg(a, 16) || !is_rm(b, 16))
+            bad_operands(mn);
+        encode2(0x66, false, 0x0f, n, a->reg, b);
+        return;
+    }
+    if (!strcmp(mn, "pshufd")) {
+        if (!is_reg(a, 16) || !is_rm(b, 16) || ops[2].kind != OP_IMM)
+            bad_operands(mn);
+        encode2(0x66, false, 0x0f, 0x70, a->reg, b);
+        put1(ops[2].imm);
+        return;
+    }
+    if (!strcmp(mn, "movq")) {
+        if (!is_rm(a, 8) || !is_reg(b, 16))
+            bad_operands(mn);
+        encode2(0x66, true, 0x0f, 0x7e, b->reg, a);
+        return;
+    }
+
+    if (!strcmp(mn, "lea")) {
+        if (!is_reg(a, 8) || b->kind != OP_MEM)
+            bad_operands(mn);
+        encode1(0, true, 0x8d, a->reg, b);
+        return;
+    }
+
+    if ((n = alu_code(mn)) >= 0) {
+        if (is_rm(a, 8) && is_reg(b, 8)) {
+            encode1(0, true, 0x01 + 8 * n, b->reg, a);
+        } else if (is_reg(a, 8) && b->kind == OP_MEM) {
+            encode1(0, true, 0x03 + 8 * n, a->reg, b);
+        } else if (is_rm(a, 8) && b->kind == OP_IMM) {
+            bool imm8 = !b->sym && is_imm8(b->imm);
+            encode1(0, true, imm8 ? 0x83 : 0x81, n, a);
+            put_imm(b, imm8);
+        } else {
+            bad_operands(mn);
+        }
+        return;
+    }
+
+    if (!strcmp(mn, "test")) {
+        if (!is_rm(a, 8) || !is_reg(b, 8))
+            bad_operands(mn);
+        encode1(0, true, 0x85, b->reg, a);
+        return;
+    }
+
+    if (!strcmp(mn, "imul")) {
+        if (nops == 2 && is_reg(a, 8) && is_rm(b, 8)) {
+            encode2(0, true, 0x0f, 0xaf, a->reg, b);
+        } else if (nops == 2 && is_reg(a, 8) && b->kind == OP_IMM) {
+            bool imm8 = is_imm8(b->imm);
+            encode1(0, true, imm8 ? 0x6b : 0x69, a->reg, a);
+            put_imm(b, imm8);
+        } else {
+            bad_operands(mn);
+        }
+        return;
+    }
+
+    if (!strcmp(mn, "idiv") || !strcmp(mn, "neg") || !strcmp(mn, "not") ||
+        !strcmp(mn, "inc") || !strcmp(mn, "dec")) {
+        if (!is_rm(a, 8))
+            bad_operands(mn);
+        if (mn[0] == 'i' && mn[1] == 'd')
+            encode1(0, true, 0xf7, 7, a);
+        else if (mn[0] == 'n' && mn[1] == 'e')
+            encode1(0, true, 0xf7, 3, a);
+        else if (mn[0] == 'n')
+            encode1(0, true, 0xf7, 2, a);
+        else
+            encode1(0, true, 0xff, mn[0] == 'i' ? 0 : 1, a);
+        return;
+    }
+
+    if (!strcmp(mn, "shl") || !strcmp(mn, "sar") || !strcmp(mn, "shr")) {
+        if (!is_rm(a, 8) || b->kind != OP_IMM)
+            bad_operands(mn);
+        int ext = mn[1] == 'h' && mn[2] == 'l' ? 4 : mn[1] == 'a' ? 7 : 5;
+        encode1(0, true, 0xc1, ext, a);
+        put1(b->imm);
+        return;
+    }
+
+    if (!strcmp(mn, "movsx") || !strcmp(mn, "movzx") || !strcmp(mn, "movzb")) {
+        if (!is_reg(a, 8) || !is_rm(b, 1))
+            bad_operands(mn);
+        encode2(0, true, 0x0f, !strcmp(mn, "movsx") ? 0xbe : 0xb6, a->reg, b);
+        return;
+    }
+
+    if (!strncmp(mn, "set", 3) && (n = cond_code(mn + 3)) >= 0) {
+        if (!is_rm(a, 1))
+            bad_operands(mn);
+        encode2(0, false, 0x0f, 0x90 + n, 0, a);
+        return;
+    }
+
+    if (!strcmp(mn, "jmp") || !strcmp(mn, "call")) {
+        if (a->kind == OP_SYM)
+            rel32(mn[0] == 'j' ? 0xe9 : 0xe8, -1, a);
+        else if (is_rm(a, 8))
+            encode1(0, false, 0xff, mn[0] == 'j' ? 4 : 2, a);
+        else
+            bad_operands(mn);
+        return;
+    }
+
+    if (mn[0] == 'j' && (n = cond_code(mn + 1)) >= 0) {
+        rel32(0x0f, 0x80 + n, a);
+        return;
+    }
+
+    jit_error("対応していない命令です: %s", mn);
+}
+
+//
+// 疑似命令
+//
+
+static void align_section(long align) {
+    Section *s = &sections[cur_sec];
+    while (s->len % align)
+        put1(cur_sec == SEC_TEXT ? 0x90 : 0);
+}
+
+static void define_label(char *name) {
+    Symbol *sym = intern(name);
+    if (sym->defined)
+        jit_error("%s が二重に定義されています", name);
+    sym->defined = true;
+    sym->sec = cur_sec;
+    sym->off = sections[cur_sec].len;
+}
+
+static void read_string(char *p) {
+    p = skip_blank(p);
+    if (*p != '"')
+        jit_error("文字列がありません");
+    p++;
+    while (*p != '"') {
+        if (!*p)
+            jit_error("文字列が閉じられていません");
+        if (*p != '\\') {
+            put1(*p++);
+            continue;
+        }
+        p++;
+        if ('0' <= *p && *p <= '7') {
+            int c = 0;
+            for (int i = 0; i < 3 && '0' <= *p && *p <= '7'; i++)
+                c = c * 8 + *p++ - '0';
+            put1(c);
+            continue;
+        }
+        switch (*p) {
+            case 'n': put1('\n'); break;
+            case 't': put1('\t'); break;
+            default: put1(*p); break;
+        }
+        p++;
+    }
+    put1(0);
+}
+
+static void assemble_directive(char *p) {
+    char *name = read_name(&p);
+
+    if (!strcmp(name, ".intel_syntax") || !strcmp(name, ".global") ||
+        !strcmp(name, ".globl"))
+        return;
+    if (!strcmp(name, ".text")) {
+        cur_sec = SEC_TEXT;
+        return;
+    }
+    if (!strcmp(name, ".data")) {
+        cur_sec = SEC_DATA;
+        return;
+    }
+    if (!strcmp(name, ".bss")) {
+        cur_sec = SEC_BSS;
+        return;
+    }
+    if (!strcmp(name, ".section")) {
+        char *sec = read_name(&p);
+        if (!strcmp(sec, ".rodata"))
+            cur_sec = SEC_RODATA;
+        else if (!strcmp(sec, ".text"))
+            cur_sec = SEC_TEXT;
+        else if (!strcmp(sec, ".data"))
+            cur_sec = SEC_DATA;
+        else if (!strcmp(sec, ".bss"))
+            cur_sec = SEC_BSS;
+        else if (!strcmp(sec, ".fini_array"))
+            cur_sec = SEC_FINI;
+        else
+            jit_error("対応していないセクションです: %s", sec);
+        return;
+    }
+    if (!strcmp(name, ".align")) {
+        align_section(read_number(&p));
+        return;
+    }
+    if (!strcmp(name, ".zero")) {
+        for (long n = read_number(&p); n > 0; n--)
+            put1(0);
+        return;
+    }
+    if (!strcmp(name, ".byte")) {
+        put1(read_number(&p));
+        return;
+    }
+    if (!strcmp(name, ".quad")) {
+        p = skip_blank(p);
+        if (isdigit(*p) || *p == '-')
+            put8(read_number(&p));
+        else
+            add_fixup(FX_ABS64, read_name(&p), 0);
+        return;
+    }
+    if (!strcmp(name, ".string")) {
+        read_string(p);
+        return;
+    }
+    if (!strcmp(name, ".set")) {
+        Symbol *sym = intern(read_name(&p));
+        p = skip_blank(p);
+        if (*p++ != ',')
+            jit_error(".set の書式が正しくありません");
+        sym->alias = intern(read_name(&p));
+        p = skip_blank(p);
+        if (*p == '+' || *p == '-')
+            sym->addend = read_number(&p);
+        sym->defined = true;
+        return;
+    }
+
+    jit_error("対応していない疑似命令です: %s", name);
+}
+
+static void assemble_line(char *line) {
+    char *p = skip_blank(line);
+    if (!*p)
+        return;
+    insn_fixups = NULL;
+
+    if (*p == '.' && !strchr(p, ':')) {
+        assemble_directive(p);
+        return;
+    }
+
+    char *q = p;
+    while (is_symchar(*q))
+        q++;
+    if (*q == ':') {
+        define_label(strndup(p, q - p));
+        return;
+    }
+
+    char *mn = read_name(&p);
+    Operand ops[3] = {};
+    int nops = 0;
+    for (;;) {
+        p = skip_blank(p);
+        if (!*p)
+            break;
+        if (nops == 3)
+            jit_error("オペランドが多すぎます");
+        read_operand(&p, &ops[nops++]);
+        p = skip_blank(p);
+        if (*p == ',')
+            p++;
+    }
+
+    if (cur_sec != SEC_TEXT)
+        jit_error("命令が .text の外にあります");
+    assemble_insn(mn, ops, nops);
+
+    // RIP 相対は命令の終わりからの距離になる
+    if (!insn_fixups)
+        return;
+    for (Fixup *fx = fixups; fx; fx = fx->next) {
+        fx->end = sections[SEC_TEXT].len;
+        if (fx == insn_fixups)
+            break;
+    }
+}
+
+//
+// 配置と実行
+//
+
+static long align_up(long n, long align) {
+    return (n + align - 1) / align * align;
+}
+
+static long symbol_addr(Symbol *sym) {
+    if (sym->alias)
+        return symbol_addr(sym->alias) + sym->addend;
+    if (sym->defined)
+        return sections[sym->sec].addr + sym->off;
+    if (sym->stub >= 0)
+        return sections[SEC_TEXT].addr + sym->stub;
+    jit_error("%s が定義されていません", sym->name);
+    return 0;
+}
+
+// 未定義の関数ごとに jmp [rip+0]; .quad addr という中継コードを作る。
+// libc は 2GB より遠くにあるので直接 call rel32 では届かない。
+static void make_stubs() {
+    cur_sec = SEC_TEXT;
+    for (Fixup *fx = fixups; fx; fx = fx->next) {
+        Symbol *sym = fx->sym;
+        if (sym->defined || sym->stub >= 0)
+            continue;
+
+        void *addr = dlsym(RTLD_DEFAULT, sym->name);
+        if (!addr)
+            jit_error("%s が見つかりません", sym->name);
+        align_section(8);
+        sym->stub = sections[SEC_TEXT].len;
+        put1(0xff);
+        put1(0x25);
+        put4(0);
+        put8((long)addr);
+    }
+}
+
+static void apply_fixups() {
+    for (Fixup *fx = fixups; fx; fx = fx->next) {
+        Section *s = &sections[fx->sec];
+        unsigned char *loc = (unsigned char *)s->addr + fx->off;
+        long val = symbol_addr(fx->sym) + fx->addend;
+
+        switch (fx->kind) {
+            case FX_REL32:
+                val -= s->addr + fx->end;
+                // fallthrough
+            case FX_ABS32:
+                if (!is_imm32(val))
+                    jit_error("%s まで 32 ビットで届きません", fx->sym->name);
+                *(int32_t *)loc = val;
+                break;
+            case FX_ABS64:
+                *(int64_t *)loc = val;
+                break;
+        }
+    }
+}
+
+int jit_run(char *asm_text) {
+    cur_sec = SEC_TEXT;
+    line_no = 0;
+    for (char *p = asm_text; *p;) {
+        char *end = strchr(p, '\n');
+        if (!end)
+            end = p + strlen(p);
+        char *line = strndup(p, end - p);
+        line_no++;
+        assemble_line(line);
+        free(line);
+        p = *end ? end + 1 : end;
+    }
+    make_stubs();
+
+    // .text | .rodata | .data | .bss | .fini_array をページ単位で並べる
+    long page = sysconf(_SC_PAGESIZE);
+    long size = 0;
+    for (int i = 0; i < NUM_SECTIONS; i++)
+        size += align_up(sections[i].len, page);
+
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (base == MAP_FAILED)
+        error("mmap: %s", strerror(errno));
+
+    long off = 0;
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        sections[i].addr = (long)base + off;
+        if (i != SEC_BSS)
+            memcpy(base + off, sections[i].buf, sections[i].len);
+        off += align_up(sections[i].len, page);
+    }
+
+    apply_fixups();
+
+    long text_size = align_up(sections[SEC_TEXT].len, page);
+    if (text_size && mprotect(base, text_size, PROT_READ | PROT_EXEC))
+        error("mprotect: %s", strerror(errno));
+
+    Symbol *main_sym = intern("main");
+    if (!main_sym->defined)
+        error("main がありません");
+    int (*main_fn)() = (int (*)())symbol_addr(main_sym);
+    int ret = main_fn();
+
+    Section *fini = &sections[SEC_FINI];
+    for (long i = 0; i < fini->len; i += 8)
+        (*(void (**)())(fini->addr + i))();
+
+    fflush(stdout);
+    return ret;
+}
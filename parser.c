@@ -1,27 +1,79 @@
 #include "9cc.h"
 
-static VarList *locals;
-static VarList *globals;
+static _Thread_local VarList *locals;
+static _Thread_local VarList *globals;
+static _Thread_local int label_cnt; // 文字列リテラルのラベルの番号
 
-static Var *find_var(Token *tok) {
+static _Thread_local Node *current_switch; // case を登録する switch
+static _Thread_local int breakable; // break で抜けられる文の入れ子の深さ
+
+static Var *find_var(Token tok) {
     for (VarList *vl = locals; vl; vl = vl->next) {
         Var *var = vl->var;
-        if (strlen(var->name) == tok->len 
-                && !memcmp(tok->str, var->name, tok->len))
+        if (strlen(var->name) == tok_len(tok) 
+                && !memcmp(tok_str(tok), var->name, tok_len(tok)))
             return var;
     }
 
     for (VarList *vl = globals; vl; vl = vl->next) {
         Var *var = vl->var;
-        if (strlen(var->name) == tok->len
-                && !memcmp(tok->str, var->name, tok->len))
+        if (strlen(var->name) == tok_len(tok)
+                && !memcmp(tok_str(tok), var->name, tok_len(tok)))
             return var;
     }
     return NULL;
 }
 
+// 同じ内容の文字列リテラルは一つのラベルを共有する。内容で引けるように
+// 開番地法のハッシュ表に入れておく
+static _Thread_local Var **strings;
+static _Thread_local int strings_cap;
+static _Thread_local int strings_used;
+
+static unsigned hash_string(char *contents, int len) {
+    unsigned h = 2166136261;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)contents[i]) * 16777619;
+    return h;
+}
+
+static Var **string_slot(char *contents, int len) {
+    int i = hash_string(contents, len) & (strings_cap - 1);
+    for (; strings[i]; i = (i + 1) & (strings_cap - 1)) {
+        Var *var = strings[i];
+        if (var->cont_len == len && !memcmp(var->contents, contents, len))
+            break;
+    }
+    return &strings[i];
+}
+
+static Var *find_string(char *contents, int len) {
+    return strings ? *string_slot(contents, len) : NULL;
+}
+
+static void add_string(Var *var) {
+    if ((strings_used + 1) * 2 > strings_cap) {
+        Var **old = strings;
+        int old_cap = strings_cap;
+        strings_cap = strings_cap ? strings_cap * 2 : 64;
+        strings = calloc(strings_cap, sizeof(Var *));
+        for (int i = 0; i < old_cap; i++)
+            if (old[i])
+                *string_slot(old[i]->contents, old[i]->cont_len) = old[i];
+        free(old);
+    }
+    *string_slot(var->contents, var->cont_len) = var;
+    strings_used++;
+}
+
+static void clear_strings() {
+    free(strings);
+    strings = NULL;
+    strings_cap = strings_used = 0;
+}
+
 static Var *new_var(char *name, Type *ty, bool is_local) {
-    Var *var = calloc(1, sizeof(Var));
+    Var *var = arena_alloc(sizeof(Var));
     var->name = name;
     var->ty = ty;
     var->is_local = is_local;
@@ -31,7 +83,7 @@ static Var *new_var(char *name, Type *ty, bool is_local) {
 static Var *new_lvar(char *name, Type *ty) {
     Var *var = new_var(name, ty, true);
 
-    VarList *vl = calloc(1, sizeof(VarList));
+    VarList *vl = arena_alloc(sizeof(VarList));
     vl->var = var;
     vl->next = locals;
     locals = vl;
@@ -41,7 +93,7 @@ static Var *new_lvar(char *name, Type *ty) {
 static Var *new_gvar(char *name, Type *ty) {
     Var *var = new_var(name, ty, false);
 
-    VarList *vl = calloc(1, sizeof(VarList));
+    VarList *vl = arena_alloc(sizeof(VarList));
     vl->var = var;
     vl->next = globals;
     globals = vl;
@@ -50,23 +102,23 @@ static Var *new_gvar(char *name, Type *ty) {
 
 static Type *basetype() {
     Type *ty;
-    if (consume("char")) {
+    if (consume(KW_CHAR)) {
         ty = char_type;
     } else {
-        expect("int");
+        expect(KW_INT);
         ty = int_type;
     }
 
-    while (consume("*"))
+    while (consume(PU_MUL))
         ty = pointer_to(ty);
     return ty;
 }
 
 static Type *read_type_suffix(Type *base){
-    if (!consume("["))
+    if (!consume(PU_LBRACKET))
         return base;
     int sz = expect_number();
-    expect("]");
+    expect(PU_RBRACKET);
     base = read_type_suffix(base);
     return array_of(base, sz);
 }
@@ -77,20 +129,20 @@ static VarList *read_func_param() {
     ty = read_type_suffix(ty);
 
 
-    VarList *vl = calloc(1, sizeof(VarList));
+    VarList *vl = arena_alloc(sizeof(VarList));
     vl->var = new_lvar(name, ty);
     return vl;
 }
 
 static VarList *read_func_params() {
-    if (consume(")"))
+    if (consume(PU_RPAREN))
         return NULL;
 
     VarList *head = read_func_param();
     VarList *cur = head;
 
-    while(!consume(")")) {
-        expect(",");
+    while(!consume(PU_RPAREN)) {
+        expect(PU_COMMA);
         cur->next = read_func_param();
         cur = cur->next;
     }
@@ -98,38 +150,73 @@ static VarList *read_func_params() {
 }
 
 static bool is_typename() {
-    return peek("char") || peek("int");
+    return peek(KW_CHAR) || peek(KW_INT);
+}
+
+// 種別ごとに使うフィールドまでの大きさ
+static size_t node_size(NodeKind kind) {
+    switch (kind) {
+        case ND_NUM:
+            return offsetof(Node, val) + sizeof(long);
+        case ND_VAR:
+            return offsetof(Node, var) + sizeof(Var *);
+        case ND_NULL:
+        case ND_BREAK:
+            return offsetof(Node, lhs);
+        case ND_BLOCK:
+            return offsetof(Node, body) + sizeof(Node *);
+        case ND_FUNCALL:
+            return offsetof(Node, args) + sizeof(Node *);
+        case ND_IF:
+        case ND_WHILE:
+            return offsetof(Node, counter) + sizeof(int);
+        case ND_FOR:
+            return offsetof(Node, vec) + sizeof(VecLoop *);
+        case ND_SWITCH:
+        case ND_CASE:
+            return offsetof(Node, case_label) + sizeof(int);
+        default:
+            return offsetof(Node, rhs) + sizeof(Node *);
+    }
 }
 
-static Node *new_node(NodeKind kind, Token *tok)
+Node *new_node(NodeKind kind, char *loc)
 {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(node_size(kind));
     node->kind = kind;
-    node->tok = tok;
+    node->loc = loc;
     return node;
 }
 
-static Node *new_num(long num, Token *tok) {
-    Node *node = new_node(ND_NUM, tok);
+// ノードを一つだけ複製する。子は共有する
+Node *copy_node(Node *node) {
+    Node *copy = new_node(node->kind, node->loc);
+    memcpy(copy, node, node_size(node->kind));
+    return copy;
+}
+
+Node *new_num(long num, char *loc) {
+    Node *node = new_node(ND_NUM, loc);
     node->val = num;
     return node;
 }
 
-static Node *new_unary(NodeKind kind, Node *lhs, Token *tok) {
-    Node *node = new_node(kind, tok);
+Node *new_unary(NodeKind kind, Node *lhs, char *loc) {
+    Node *node = new_node(kind, loc);
     node->kind = kind;
     node->lhs = lhs;
     return node;
 }
 
-static Node *new_var_node(Var *var, Token *tok) {
-    Node *node = new_node(ND_VAR, tok);
+Node *new_var_node(Var *var, char *loc) {
+    Node *node = new_node(ND_VAR, loc);
     node->var = var;
+    var->refcnt++;
     return node;
 }
 
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
-    Node *node = new_node(kind, tok);
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, char *loc) {
+    Node *node = new_node(kind, loc);
     node->kind = kind;
     node->lhs = lhs;
     node->rhs = rhs;
@@ -137,10 +224,9 @@ static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
 }
 
 static char *new_label() {
-    static int cnt = 0;
     char buf[20];
-    sprintf(buf, ".L.data.%d", cnt++);
-    return strndup(buf, 20);
+    sprintf(buf, ".L.data.%d", label_cnt++);
+    return arena_strndup(buf, 20);
 }
 
 static Function *function();
@@ -149,11 +235,7 @@ static void global_var();
 static Node *stmt();
 static Node *stmt2();
 static Node *expr();
-static Node *assign();
-static Node *equality();
-static Node *relational();
-static Node *add();
-static Node *mul();
+static Node *binary(int min_prec);
 static Node *unary();
 static Node *postfix();
 static Node *primary();
@@ -165,22 +247,22 @@ static Node *primary();
 //         | "if" "(" expr ")" stmt ("else" stmt)?
 //         | "while" "(" expr ")" stmt
 //         | "for" "(" expr? ";" expr? ";" expr? ")" stmt
+//         | "switch" "(" expr ")" stmt
+//         | "case" "-"? num ":" stmt
+//         | "default" ":" stmt
+//         | "break" ";"
 //         | "return" expr ";"
-// expr = assign
-// assign = equality ("=" assign)?
-// equality = relational ("==" relational| "!=" relational)*
-// relational = add ("<=" add | "<" add | ">=" add | ">" add)*
-// add = mul ("+" mul | "-" mul)*
-// mul = unary ("*" unary | "/" unary)*
-// unary = ("+" | "-" | "*" | "&" )? unary
+// expr = binary
+// binary = unary (binop binary)*   binop の結合の強さは binops で決まる
+// unary = ("+" | "-" | "*" | "&" | "!")? unary
 //       | postfix   
 // postfix = primary ("[" expr "]")*
 // primary = num | indent func_args? | "(" expr ")"
 
 static bool is_function() {
-    Token *tok = token;
+    Token tok = token;
     basetype();
-    bool isFunc = consume_ident() && consume("(");
+    bool isFunc = consume_ident() && consume(PU_LPAREN);
     token = tok;
     return isFunc;
 }
@@ -190,6 +272,11 @@ Program *program() {
     Function head = {};
     Function *cur = &head;
     globals = NULL;
+    label_cnt = 0;
+    // 前のコンパイルがエラーで抜けたときの分を捨てる
+    clear_strings();
+    current_switch = NULL;
+    breakable = 0;
 
     while(!at_eof()) {
         if (is_function()) {
@@ -200,7 +287,9 @@ Program *program() {
         }
     }
 
-    Program *prog = calloc(1, sizeof(Program));
+    clear_strings();
+
+    Program *prog = arena_alloc(sizeof(Program));
     prog->globals = globals;
     prog->fns = head.next;
     return prog;
@@ -212,17 +301,17 @@ Program *program() {
 static Function *function() {
     locals = NULL;
 
-    Function *fn = calloc(1, sizeof(Function));
+    Function *fn = arena_alloc(sizeof(Function));
     basetype();
     fn->name = expect_ident();
-    expect("(");
+    expect(PU_LPAREN);
     fn->params = read_func_params();
-    expect("{");
+    expect(PU_LBRACE);
 
     Node head = {};
     Node *cur = &head;
 
-    while(!consume("}")) {
+    while(!consume(PU_RBRACE)) {
         cur->next = stmt();
         cur = cur->next;
     }
@@ -237,31 +326,31 @@ static void global_var() {
     Type *ty = basetype();
     char *name = expect_ident();
     ty = read_type_suffix(ty);
-    expect(";");
+    expect(PU_SEMICOLON);
     new_gvar(name, ty);
 }
 
 // declation = basetype ident ("[" num "]")* ("=" expr) ";"
 static Node *declaration() {
-    Token *tok = token;
+    char *loc = tok_str(token);
     Type *ty = basetype();
     char *name = expect_ident();
     ty = read_type_suffix(ty);
     Var *var = new_lvar(name, ty);
-    if (consume(";"))
-        return new_node(ND_NULL, tok);
+    if (consume(PU_SEMICOLON))
+        return new_node(ND_NULL, loc);
 
-    expect("=");
-    Node *lhs = new_var_node(var, tok);
+    expect(PU_ASSIGN);
+    Node *lhs = new_var_node(var, loc);
     Node *rhs = expr();
-    expect(";");
-    Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
-    return new_unary(ND_EXPR_STMT, node, tok);
+    expect(PU_SEMICOLON);
+    Node *node = new_binary(ND_ASSIGN, lhs, rhs, loc);
+    return new_unary(ND_EXPR_STMT, node, loc);
 }
 
 static Node *read_expr_stmt() {
-    Token *tok = token;
-    return new_unary(ND_EXPR_STMT, expr(), tok);
+    char *loc = tok_str(token);
+    return new_unary(ND_EXPR_STMT, expr(), loc);
 }
 
 static Node *stmt() {
@@ -270,64 +359,128 @@ static Node *stmt() {
     return node;
 }
 
+// break で抜けられる文の本体
+static Node *breakable_stmt() {
+    breakable++;
+    Node *node = stmt();
+    breakable--;
+    return node;
+}
+
+static long case_value() {
+    if (consume(PU_SUB))
+        return -expect_number();
+    return expect_number();
+}
+
 // stmt = expr ";"
 //         | "{" stmt* "}"
 //         | "if" "(" expr ")" stmt ("else" stmt)?
 //         | "while" "(" expr ")" stmt
 //         | "for" "(" expr? ";" expr? ";" expr? ")" stmt
+//         | "switch" "(" expr ")" stmt
+//         | "case" "-"? num ":" stmt
+//         | "default" ":" stmt
+//         | "break" ";"
 //         | declaration
 //         | "return" expr ";"
 static Node *stmt2() {
-    Token *tok;
-    if ((tok = consume("return"))) {
-        Node *node = new_unary(ND_RETURN, expr(), tok);
-        expect(";");
+    char *loc;
+    if ((loc = consume(KW_RETURN))) {
+        Node *node = new_unary(ND_RETURN, expr(), loc);
+        expect(PU_SEMICOLON);
         return node;
     }
-    if ((tok = consume("if"))) {
-        Node *node = new_node(ND_IF, tok);
-        expect("(");
+    if ((loc = consume(KW_IF))) {
+        Node *node = new_node(ND_IF, loc);
+        expect(PU_LPAREN);
         node->cond = expr();
-        expect(")");
+        expect(PU_RPAREN);
         node->then = stmt();
-        if (consume("else"))
+        if (consume(KW_ELSE))
             node->els = stmt();
         return node;
     }
-    if ((tok = consume("while"))) {
-        Node *node = new_node(ND_WHILE, tok);
-        expect("(");
+    if ((loc = consume(KW_WHILE))) {
+        Node *node = new_node(ND_WHILE, loc);
+        expect(PU_LPAREN);
         node->cond = expr();
-        expect(")");
-        node->then = stmt();
+        expect(PU_RPAREN);
+        node->then = breakable_stmt();
         return node;
     }
-    if ((tok = consume("for"))) {
-        Node *node = new_node(ND_FOR, tok);
-        expect("(");
-        if (!consume(";")) {
+    if ((loc = consume(KW_FOR))) {
+        Node *node = new_node(ND_FOR, loc);
+        expect(PU_LPAREN);
+        if (!consume(PU_SEMICOLON)) {
             node->init = read_expr_stmt();
-            expect(";");
+            expect(PU_SEMICOLON);
         }
-        if (!consume(";")) {
+        if (!consume(PU_SEMICOLON)) {
             node->cond = expr();
-            expect(";");
+            expect(PU_SEMICOLON);
         }
-        if (!consume(")")) {
+        if (!consume(PU_RPAREN)) {
             node->inc = read_expr_stmt();
-            expect(")");
+            expect(PU_RPAREN);
         }
+        node->then = breakable_stmt();
+        return node;
+    }
+    if ((loc = consume(KW_SWITCH))) {
+        Node *node = new_node(ND_SWITCH, loc);
+        expect(PU_LPAREN);
+        node->cond = expr();
+        expect(PU_RPAREN);
+
+        Node *sw = current_switch;
+        current_switch = node;
+        node->then = breakable_stmt();
+        current_switch = sw;
+        return node;
+    }
+    if ((loc = consume(KW_CASE))) {
+        if (!current_switch)
+            error_at(loc, "switch の外に case があります");
+        long val = case_value();
+        expect(PU_COLON);
+
+        for (Node *c = current_switch->case_next; c; c = c->case_next)
+            if (c->case_val == val)
+                error_at(loc, "case の値が重複しています");
+        Node *node = new_node(ND_CASE, loc);
+        node->case_val = val;
+        node->case_next = current_switch->case_next;
+        current_switch->case_next = node;
         node->then = stmt();
         return node;
     }
-    if ((tok = consume("{"))) {
+    if ((loc = consume(KW_DEFAULT))) {
+        if (!current_switch)
+            error_at(loc, "switch の外に default があります");
+        if (current_switch->default_case)
+            error_at(loc, "default が重複しています");
+        expect(PU_COLON);
+
+        Node *node = new_node(ND_CASE, loc);
+        current_switch->default_case = node;
+        node->then = stmt();
+        return node;
+    }
+    if ((loc = consume(KW_BREAK))) {
+        if (!breakable)
+            error_at(loc, "ループか switch の外に break があります");
+        expect(PU_SEMICOLON);
+        return new_node(ND_BREAK, loc);
+    }
+    if ((loc = consume(PU_LBRACE))) {
         Node head = {};
         Node *cur = &head;
-        while(!consume("}")) {
+        while(!consume(PU_RBRACE)) {
             cur->next = stmt();
             cur = cur->next;
         }
-        Node *node = new_node(ND_BLOCK, tok);
+        Node *node = new_node(ND_BLOCK, loc);
         node->body = head.next;
         return node;
     }
@@ -336,176 +489,140 @@ static Node *stmt2() {
         return declaration();
 
     Node *node = read_expr_stmt();
-    expect(";");
-    return node;
-}
-
-// assign
-static Node *expr() {
-    return assign();
-}
-
-// equality ("=" assign)?
-static Node *assign() {
-    Node *node = equality();
-
-    Token *tok;
-    if ((tok = consume("=")))
-        node = new_binary(ND_ASSIGN, node, assign(), tok);
-    return node;
-}
-
-// equality = relational ("==" relational| "!=! relational)*
-static Node *equality() {
-    Node *node = relational();
-    Token *tok;
-
-    for (;;) {
-        if ((tok = consume("=="))) {
-            node = new_binary(ND_EQ, node, relational(), tok);
-            continue;
-        }
-        if ((tok = consume("!="))) {
-            node = new_binary(ND_NE, node, relational(), tok);
-            continue;
-        }
-        break;
-    }
-    return node;
-}
-
-// relational = add ("<=" add | "<" add | ">=" add | ">" add)*
-static Node *relational() {
-    Node *node = add();
-    Token *tok;
-
-    for (;;) {
-        if ((tok = consume("<="))) {
-            node = new_binary(ND_LE, node, add(), tok);
-            continue;
-        }
-        if ((tok = consume("<"))) {
-            node = new_binary(ND_LT, node, add(), tok);
-            continue;
-        }
-        if ((tok = consume(">="))) {
-            node = new_binary(ND_LE, add(), node, tok);
-            continue;
-        }
-        if ((tok = consume(">"))) {
-            node = new_binary(ND_LT, add(), node, tok);
-            continue;
-        }
-        break;
-    }
+    expect(PU_SEMICOLON);
     return node;
 }
 
-static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
+static Node *new_add(Node *lhs, Node *rhs, char *loc) {
     add_type(lhs);
     add_type(rhs);
 
     if (is_integer(lhs->ty) && is_integer(rhs->ty))
-        return new_binary(ND_ADD, lhs, rhs, tok);
+        return new_binary(ND_ADD, lhs, rhs, loc);
     if (lhs->ty->base && is_integer(rhs->ty))
-        return new_binary(ND_PTR_ADD, lhs, rhs, tok);
+        return new_binary(ND_PTR_ADD, lhs, rhs, loc);
     if (is_integer(lhs->ty) && rhs->ty->base)
-        return new_binary(ND_PTR_ADD, rhs, lhs, tok);
-    error_tok(tok, "invalid operands");
+        return new_binary(ND_PTR_ADD, rhs, lhs, loc);
+    error_at(loc, "invalid operands");
 }
 
-static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
+static Node *new_sub(Node *lhs, Node *rhs, char *loc) {
     add_type(lhs);
     add_type(rhs);
 
     if (is_integer(lhs->ty) && is_integer(rhs->ty))
-        return new_binary(ND_SUB, lhs, rhs, tok);
+        return new_binary(ND_SUB, lhs, rhs, loc);
     if (lhs->ty->base && is_integer(rhs->ty))
-        return new_binary(ND_PTR_SUB, lhs, rhs, tok);
+        return new_binary(ND_PTR_SUB, lhs, rhs, loc);
     if (is_integer(rhs->ty) && lhs->ty->base)
-        return new_binary(ND_PTR_SUB, rhs, lhs, tok);
+        return new_binary(ND_PTR_SUB, rhs, lhs, loc);
     if (lhs->ty->base && rhs->ty->base)
-        return new_binary(ND_PTR_DIFF, lhs, rhs, tok);
-    error_tok(tok, "invalid operands");
-}
+        return new_binary(ND_PTR_DIFF, lhs, rhs, loc);
+    error_at(loc, "invalid operands");
+}
+
+// 二項演算子の表。トークンの記号の番号で引く。
+// 結合の強さは弱い方から = || && (== !=) (< <= > >=) (+ -) (* /) で、
+// = だけが右結合
+typedef struct {
+    int prec; // 0 なら二項演算子ではない
+    NodeKind kind;
+    bool swap; // > と >= は左右を入れ替えて < と <= にする
+} BinOp;
+
+static const BinOp binops[NUM_RESERVED] = {
+    [PU_ASSIGN] = {1, ND_ASSIGN},
+    [PU_LOGOR] = {2, ND_LOGOR},
+    [PU_LOGAND] = {3, ND_LOGAND},
+    [PU_EQ] = {4, ND_EQ},
+    [PU_NE] = {4, ND_NE},
+    [PU_LT] = {5, ND_LT},
+    [PU_LE] = {5, ND_LE},
+    [PU_GT] = {5, ND_LT, true},
+    [PU_GE] = {5, ND_LE, true},
+    [PU_ADD] = {6, ND_ADD},
+    [PU_SUB] = {6, ND_SUB},
+    [PU_MUL] = {7, ND_MUL},
+    [PU_DIV] = {7, ND_DIV},
+};
 
-static Node *add() {
-    Node *node = mul();
-    Token *tok;
-
-    for(;;) {
-        if ((tok = consume("+"))) {
-            node = new_add(node, mul(), tok);
-            continue;
-        }
-        if ((tok = consume("-"))) {
-            node = new_sub(node, mul(), tok);
-            continue;
-        }
-        break;
-    }
-    return node;
+static Node *expr() {
+    return binary(1);
 }
 
-// mul = unary ("*" unary | "/" unary)*
-static Node *mul() {
+// 結合の強さが min_prec 以上の二項演算子だけを読む
+static Node *binary(int min_prec) {
     Node *node = unary();
-    Token *tok;
 
-    for(;;) {
-        if ((tok = consume("*"))) {
-            node = new_binary(ND_MUL, node, unary(), tok);
-            continue;
-        }
-        if ((tok = consume("/"))) {
-            node = new_binary(ND_DIV, node, unary(), tok);
-            continue;
-        }
-        break;
+    for (;;) {
+        const BinOp *op = &binops[tok_reserved(token)];
+        if (op->prec < min_prec)
+            return node;
+        char *loc = tok_str(advance());
+        Node *rhs = binary(op->kind == ND_ASSIGN ? op->prec : op->prec + 1);
+
+        if (op->kind == ND_ADD)
+            node = new_add(node, rhs, loc);
+        else if (op->kind == ND_SUB)
+            node = new_sub(node, rhs, loc);
+        else if (op->swap)
+            node = new_binary(op->kind, rhs, node, loc);
+        else
+            node = new_binary(op->kind, node, rhs, loc);
     }
-    return node;
 }
 
-// unary = ("sizeof" | "+" | "-" | "*" | "&" )? unary
+// unary = ("+" | "-" | "*" | "&" | "!")? unary
 //       | postfix
 static Node *unary() {
-    Token *tok;
-    if (consume("+"))
-        return unary();
-    if ((tok = consume("-")))
-        return new_binary(ND_SUB, new_num(0, tok), unary(), tok);
-    if ((tok = consume("&")))
-        return new_unary(ND_ADDR, unary(), tok);
-    if ((tok = consume("*")))
-        return new_unary(ND_DEREF, unary(), tok);
-    return postfix();
+    Reserved op = tok_reserved(token);
+    if (op != PU_ADD && op != PU_SUB && op != PU_AMP && op != PU_MUL &&
+            op != PU_NOT)
+        return postfix();
+
+    char *loc = tok_str(advance());
+    Node *node = unary();
+    switch (op) {
+        case PU_SUB:
+            return new_binary(ND_SUB, new_num(0, loc), node, loc);
+        case PU_AMP:
+            if (node->kind == ND_VAR)
+                node->var->addr_taken = true;
+            return new_unary(ND_ADDR, node, loc);
+        case PU_MUL:
+            return new_unary(ND_DEREF, node, loc);
+        case PU_NOT:
+            return new_unary(ND_NOT, node, loc);
+        default:
+            return node;
+    }
 }
 
 // postfix = primary ("[" expr "]")*
 static Node *postfix() {
     Node *node = primary();
-    Token *tok;
+    char *loc;
 
-    while ((tok = consume("["))) {
-        Node *exp = new_add(node, expr(), tok);
-        expect("]");
-        node = new_unary(ND_DEREF, exp, tok);
+    while ((loc = consume(PU_LBRACKET))) {
+        Node *exp = new_add(node, expr(), loc);
+        expect(PU_RBRACKET);
+        node = new_unary(ND_DEREF, exp, loc);
     }
     return node;
 }
 
-// func_args = "(" (assign ("," assign)*)? ")"
+// func_args = "(" (expr ("," expr)*)? ")"
 static Node *func_args() {
-    if (consume(")"))
+    if (consume(PU_RPAREN))
         return NULL;
 
-    Node *head = assign();
+    Node *head = expr();
     Node *cur = head;
-    while (consume(",")) {
-        cur->next = assign();
+    while (consume(PU_COMMA)) {
+        cur->next = expr();
         cur = cur->next;
     }
-    expect(")");
+    expect(PU_RPAREN);
     return head;
 }
 
@@ -515,23 +632,24 @@ static Node *func_args() {
 //          | "(" expr ")"
 //          | str
 static Node *primary() {
-    Token *tok;
-    if (consume("(")) {
+    char *loc;
+    if (consume(PU_LPAREN)) {
         Node *node = expr();
-        expect(")");
+        expect(PU_RPAREN);
         return node;
     }
 
-    if ((tok = consume("sizeof"))) {
+    if ((loc = consume(KW_SIZEOF))) {
         Node *node = unary();
         add_type(node);
-        return new_num(node->ty->size, tok);
+        return new_num(node->ty->size, loc);
     }
 
+    Token tok;
     if ((tok = consume_ident())) {
-        if (consume("(")) {
-            Node *node = new_node(ND_FUNCALL, tok);
-            node->funcname = strndup(tok->str, tok->len);
+        if (consume(PU_LPAREN)) {
+            Node *node = new_node(ND_FUNCALL, tok_str(tok));
+            node->funcname = arena_strndup(tok_str(tok), tok_len(tok));
             node->args = func_args();
             return node;
         }
@@ -539,22 +657,26 @@ static Node *primary() {
         Var *var = find_var(tok);
         if(!var) 
             error_tok(tok, "undefined variable");
-        return new_var_node(var, tok);
+        return new_var_node(var, tok_str(tok));
     }
 
     tok = token;
-    if (tok->kind == TK_STR) {
-        token = token->next;
-
-        Type *ty = array_of(char_type, tok->cont_len);
-        Var *var = new_gvar(new_label(), ty);
-        var->contents = tok->contents;
-        var->cont_len = tok->cont_len;
-        return new_var_node(var, tok);
+    if (tok_kind(tok) == TK_STR) {
+        advance();
+
+        Var *var = find_string(tok_contents(tok), tok_cont_len(tok));
+        if (!var) {
+            Type *ty = array_of(char_type, tok_cont_len(tok));
+            var = new_gvar(new_label(), ty);
+            var->contents = tok_contents(tok);
+            var->cont_len = tok_cont_len(tok);
+            add_string(var);
+        }
+        return new_var_node(var, tok_str(tok));
     }
-    if (tok->kind != TK_NUM) {
+    if (tok_kind(tok) != TK_NUM) {
         error_tok(tok, "式ではありません");
     }
 
-    return new_num(expect_number(), tok);
+    return new_num(expect_number(), tok_str(tok));
 }
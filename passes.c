@@ -0,0 +1,278 @@
+#include "9cc.h"
+#include <time.h>
+
+// 最適化のパスを順に走らせる。
+//
+// 各パスは -O のレベルで有効になるかが決まり、-f<名前> と -fno-<名前> で
+// 個別に切り替えられる。--time-passes を付けると各パスに掛かった時間と
+// 書き換えた箇所の数を標準エラー出力へ書き出す。
+//
+// NDEBUG を定義しないビルドでは、パスの後ごとに木が壊れていないかを
+// 確かめる。
+
+static int promote_regs(Program *prog);
+
+typedef struct {
+    char *name;
+    int (*run)(Program *prog); // 書き換えた箇所の数を返す
+    int level; // この -O 以上で有効
+} Pass;
+
+static const Pass passes[] = {
+    {"vectorize", vectorize_loops, 3},
+    {"unroll", unroll_loops, 2},
+    {"ivopt", reduce_induction_vars, 2},
+    {"cse", eliminate_common_subexprs, 1},
+    {"regalloc", promote_regs, 1},
+};
+
+#define NUM_PASSES (int)(sizeof(passes) / sizeof(*passes))
+
+_Static_assert(NUM_PASSES <= MAX_PASSES, "MAX_PASSES が小さすぎます");
+
+bool set_pass(Context *ctx, char *name, bool enable) {
+    for (int i = 0; i < NUM_PASSES; i++) {
+        if (!strcmp(passes[i].name, name)) {
+            ctx->pass_flags[i] = enable ? 1 : -1;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_enabled(Context *ctx, int i) {
+    if (ctx->pass_flags[i])
+        return ctx->pass_flags[i] > 0;
+    return passes[i].level <= ctx->opt_level;
+}
+
+// 変数を callee-saved レジスタに置く。置いた変数の数を返す
+static int promote_regs(Program *prog) {
+    int n = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        assign_regs(fn);
+        n += fn->nregs;
+    }
+    return n;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifndef NDEBUG
+
+// 木の検査。ノードが二か所から指されていないこと、式に型が付いていること、
+// 使っているローカル変数が関数の locals にあることなどを確かめる
+
+static _Thread_local Node **seen;
+static _Thread_local int seen_cap;
+static _Thread_local int seen_used;
+
+// 一度目なら覚えて false, 二度目なら true
+static bool check_seen(Node *node) {
+    if ((seen_used + 1) * 2 > seen_cap) {
+        Node **old = seen;
+        int old_cap = seen_cap;
+        seen_cap = seen_cap ? seen_cap * 2 : 1024;
+        seen = calloc(seen_cap, sizeof(Node *));
+        seen_used = 0;
+        for (int i = 0; i < old_cap; i++)
+            if (old[i])
+                check_seen(old[i]);
+        free(old);
+    }
+
+    int i = ((uintptr_t)node >> 4) & (seen_cap - 1);
+    for (; seen[i]; i = (i + 1) & (seen_cap - 1))
+        if (seen[i] == node)
+            return true;
+    seen[i] = node;
+    seen_used++;
+    return false;
+}
+
+static _Thread_local char *verify_pass;
+static _Thread_local Function *verify_fn;
+static _Thread_local Node *verify_switch;
+static _Thread_local int verify_loops;
+
+static void fail(Node *node, char *msg) {
+    error_at(node->loc, "%s の後の木が壊れています (%s): %s",
+             verify_pass, verify_fn->name, msg);
+}
+
+static bool is_local_of(Var *var, Function *fn) {
+    for (VarList *vl = fn->locals; vl; vl = vl->next)
+        if (vl->var == var)
+            return true;
+    return false;
+}
+
+static void verify_expr(Node *node);
+static void verify_stmt(Node *node);
+
+static void verify_list(Node *node, void (*fn)(Node *)) {
+    for (; node; node = node->next)
+        fn(node);
+}
+
+static void verify_expr(Node *node) {
+    if (!node)
+        fail(verify_fn->node, "式がありません");
+    if (check_seen(node))
+        fail(node, "ノードが共有されています");
+    if (!node->ty)
+        fail(node, "型がありません");
+
+    switch (node->kind) {
+        case ND_NUM:
+            return;
+        case ND_VAR:
+            if (node->var->is_local && !is_local_of(node->var, verify_fn))
+                fail(node, "locals にない変数です");
+            return;
+        case ND_FUNCALL:
+            verify_list(node->args, verify_expr);
+            return;
+        case ND_ADDR:
+        case ND_DEREF:
+        case ND_NOT:
+            verify_expr(node->lhs);
+            return;
+        case ND_ADD:
+        case ND_PTR_ADD:
+        case ND_SUB:
+        case ND_PTR_SUB:
+        case ND_PTR_DIFF:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+        case ND_LOGAND:
+        case ND_LOGOR:
+        case ND_ASSIGN:
+            verify_expr(node->lhs);
+            verify_expr(node->rhs);
+            return;
+        default:
+            fail(node, "式の位置に文があります");
+    }
+}
+
+static void verify_stmt(Node *node) {
+    if (check_seen(node))
+        fail(node, "ノードが共有されています");
+
+    switch (node->kind) {
+        case ND_NULL:
+            return;
+        case ND_EXPR_STMT:
+        case ND_RETURN:
+            verify_expr(node->lhs);
+            return;
+        case ND_BLOCK:
+            verify_list(node->body, verify_stmt);
+            return;
+        case ND_IF:
+            verify_expr(node->cond);
+            verify_stmt(node->then);
+            if (node->els)
+                verify_stmt(node->els);
+            return;
+        case ND_WHILE:
+        case ND_FOR:
+            if (node->init)
+                verify_stmt(node->init);
+            if (node->cond)
+                verify_expr(node->cond);
+            if (node->inc)
+                verify_stmt(node->inc);
+            verify_loops++;
+            verify_stmt(node->then);
+            verify_loops--;
+            return;
+        case ND_SWITCH: {
+            verify_expr(node->cond);
+            Node *sw = verify_switch;
+            verify_switch = node;
+            verify_loops++;
+            verify_stmt(node->then);
+            verify_loops--;
+            verify_switch = sw;
+            return;
+        }
+        case ND_CASE: {
+            if (!verify_switch)
+                fail(node, "switch の外に case があります");
+            bool found = verify_switch->default_case == node;
+            for (Node *c = verify_switch->case_next; c && !found; c = c->case_next)
+                found = c == node;
+            if (!found)
+                fail(node, "switch に登録されていない case です");
+            verify_stmt(node->then);
+            return;
+        }
+        case ND_BREAK:
+            if (!verify_loops)
+                fail(node, "ループの外に break があります");
+            return;
+        default:
+            fail(node, "文の位置に式があります");
+    }
+}
+
+static void clear_seen() {
+    free(seen);
+    seen = NULL;
+    seen_cap = seen_used = 0;
+}
+
+static void verify(Program *prog, char *pass) {
+    // 前のコンパイルがエラーで抜けたときの分を捨てる
+    clear_seen();
+    verify_switch = NULL;
+    verify_loops = 0;
+
+    verify_pass = pass;
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        verify_fn = fn;
+        verify_list(fn->node, verify_stmt);
+    }
+    clear_seen();
+}
+
+#else
+
+static void verify(Program *prog, char *pass) {}
+
+#endif
+
+void run_passes(Program *prog, Context *ctx) {
+    double time[NUM_PASSES];
+    int changes[NUM_PASSES];
+
+    verify(prog, "parse");
+    for (int i = 0; i < NUM_PASSES; i++) {
+        if (!is_enabled(ctx, i))
+            continue;
+        double start = now();
+        changes[i] = passes[i].run(prog);
+        time[i] = now() - start;
+        verify(prog, passes[i].name);
+    }
+
+    if (!ctx->time_passes)
+        return;
+    for (int i = 0; i < NUM_PASSES; i++) {
+        if (is_enabled(ctx, i))
+            fprintf(stderr, "%-12s %10.3f ms %8d changes\n",
+                    passes[i].name, time[i] * 1000, changes[i]);
+        else
+            fprintf(stderr, "%-12s   disabled\n", passes[i].name);
+    }
+}
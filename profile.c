@@ -0,0 +1,98 @@
+#include "9cc.h"
+
+// 基本ブロックのカウンタによるプロファイル。
+//
+// --profile-generate=FILE を付けると関数の入口、if の両方の枝、
+// ループの入口と本体にカウンタを置き、終了時に FILE へ書き出す。
+// --profile-use=FILE はその結果を読み、codegen が分岐や関数の並びを
+// 決めるのに使う。カウンタは同じソースなら必ず同じ順に番号が付く。
+//
+// ファイルの中身は 8 バイトの整数の列で、先頭がカウンタの個数、
+// 残りが各カウンタの値。
+
+// --time-functions を付けると各関数の入口と出口で rdtsc を読み、
+// 呼び出し回数と掛かったサイクル数を終了時に標準エラー出力へ書き出す。
+// サイクル数はその関数から呼んだ関数の分も含む。
+
+_Thread_local bool time_functions;
+
+_Thread_local char *profile_generate;
+_Thread_local char *profile_use;
+_Thread_local int num_counters;
+
+static _Thread_local long *counts;
+
+static void assign(Node *node) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+            case ND_NUM:
+            case ND_VAR:
+            case ND_NULL:
+            case ND_BREAK:
+                break;
+            case ND_SWITCH:
+            case ND_CASE:
+                assign(node->cond);
+                assign(node->then);
+                break;
+            case ND_IF:
+            case ND_WHILE:
+            case ND_FOR:
+                node->counter = num_counters;
+                num_counters += 2;
+                assign(node->init);
+                assign(node->cond);
+                assign(node->then);
+                assign(node->els);
+                assign(node->inc);
+                break;
+            case ND_BLOCK:
+                assign(node->body);
+                break;
+            case ND_FUNCALL:
+                assign(node->args);
+                break;
+            default:
+                assign(node->lhs);
+                assign(node->rhs);
+        }
+    }
+}
+
+static void load_profile(char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        error("cannot open %s: %s", path, strerror(errno));
+
+    long n;
+    if (fread(&n, sizeof(n), 1, fp) != 1 || n != num_counters) {
+        fprintf(stderr, "%s: プロファイルがソースと一致しないので使いません\n", path);
+        fclose(fp);
+        return;
+    }
+
+    counts = arena_alloc(n * sizeof(long));
+    if (fread(counts, sizeof(long), n, fp) != n)
+        error("%s: プロファイルが壊れています", path);
+    fclose(fp);
+}
+
+void assign_counters(Program *prog) {
+    num_counters = 0;
+    counts = NULL;
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        fn->counter = num_counters++;
+        assign(fn->node);
+    }
+
+    if (profile_use)
+        load_profile(profile_use);
+}
+
+bool has_profile() {
+    return counts != NULL;
+}
+
+long profile_count(int id) {
+    return counts ? counts[id] : 0;
+}
@@ -0,0 +1,205 @@
+#include "9cc.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// コンパイルサーバ (--server=PATH) とそのクライアント。
+//
+// サーバは Unix ドメインソケットで待ち、CPU の数だけのスレッドが
+// それぞれ accept して compile を呼ぶ。アリーナはスレッドごとなので
+// 要求の間で使い回される。
+//
+// 要求はファイル名、オプション、空文字列をそれぞれ '\0' で終えて並べ、
+// その後にソースを続けたもの。クライアントは送り終えたら書き込み側を
+// 閉じる。応答は '0' か '1' の 1 バイトに、成功ならアセンブリ、
+// 失敗ならエラーメッセージを続けたもの。
+
+// fd を終わりまで読み、'\0' を付けて返す。トークナイザは 16 バイト単位で
+// 読むので、後ろに 16 バイトの余裕を残す
+static char *read_all(int fd, size_t *len) {
+    size_t cap = 4096;
+    char *buf = malloc(cap);
+    *len = 0;
+    for (;;) {
+        if (*len + 16 == cap)
+            buf = realloc(buf, cap *= 2);
+        ssize_t n = read(fd, buf + *len, cap - *len - 16);
+        if (n == 0)
+            break;
+        if (n < 0 && errno != EINTR) {
+            free(buf);
+            return NULL;
+        }
+        if (n > 0)
+            *len += n;
+    }
+    memset(buf + *len, 0, 16);
+    return buf;
+}
+
+static bool write_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool set_addr(struct sockaddr_un *addr, char *path) {
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return false;
+    *addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static void respond(int fd, char status, char *buf, size_t len) {
+    if (write_all(fd, &status, 1))
+        write_all(fd, buf, len);
+}
+
+static void handle(int fd) {
+    size_t len;
+    char *req = read_all(fd, &len);
+    if (!req)
+        return;
+
+    Context ctx;
+    init_context(&ctx);
+    char *end = req + len;
+    char *p = req;
+    char *msg = NULL;
+    if (p < end) {
+        ctx.filename = p;
+        p += strlen(p) + 1;
+    }
+    for (; p < end && *p; p += strlen(p) + 1)
+        if (!msg)
+            msg = parse_option(&ctx, p);
+    if (p >= end)
+        msg = "要求が正しくありません";
+
+    if (msg) {
+        char buf[300];
+        int n = snprintf(buf, sizeof(buf), "%s\n", msg);
+        respond(fd, '1', buf, n);
+        free(req);
+        return;
+    }
+
+    char *out;
+    size_t outlen;
+    FILE *fp = open_memstream(&out, &outlen);
+    if (compile(&ctx, p + 1, fp)) {
+        fclose(fp);
+        respond(fd, '1', ctx.error, strlen(ctx.error));
+        free(ctx.error);
+    } else {
+        fclose(fp);
+        respond(fd, '0', out, outlen);
+    }
+    free(out);
+    free(req);
+}
+
+static int listen_fd;
+
+static void *serve(void *arg) {
+    (void)arg;
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // ファイル記述子が足りないときなどは少し待ってやり直す
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            nanosleep(&(struct timespec){0, 100 * 1000 * 1000}, NULL);
+            continue;
+        }
+        handle(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+// path で要求を待ち続ける
+void run_server(char *path) {
+    struct sockaddr_un addr;
+    if (!set_addr(&addr, path))
+        error("ソケットのパスが長すぎます: %s", path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        error("socket: %s", strerror(errno));
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(listen_fd, SOMAXCONN) < 0)
+        error("%s: %s", path, strerror(errno));
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 1; i < n; i++) {
+        pthread_t th;
+        if (pthread_create(&th, NULL, serve, NULL))
+            error("スレッドを作れません");
+        pthread_detach(th);
+    }
+    serve(NULL);
+}
+
+// path のサーバに source のコンパイルを頼み、成功すればアセンブリを
+// out に書いて 0、失敗すれば ctx->error にメッセージを入れて -1 を
+// *ret に置く。サーバにつながらなかったり応答が途中で切れたりしたら
+// false を返すので、呼び出し側で自分でコンパイルする
+bool compile_remote(char *path, Context *ctx, char **args, char *source,
+                    FILE *out, int *ret) {
+    struct sockaddr_un addr;
+    if (!set_addr(&addr, path))
+        return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return false;
+    }
+
+    char *req;
+    size_t reqlen;
+    FILE *fp = open_memstream(&req, &reqlen);
+    fprintf(fp, "%s%c", ctx->filename, '\0');
+    for (char **arg = args; *arg; arg++)
+        fprintf(fp, "%s%c", *arg, '\0');
+    fprintf(fp, "%c%s", '\0', source);
+    fclose(fp);
+
+    bool sent = write_all(fd, req, reqlen);
+    free(req);
+    size_t len = 0;
+    char *resp = NULL;
+    if (sent && shutdown(fd, SHUT_WR) == 0)
+        resp = read_all(fd, &len);
+    close(fd);
+
+    if (!resp || len == 0 || (resp[0] != '0' && resp[0] != '1')) {
+        free(resp);
+        return false;
+    }
+
+    if (resp[0] == '0') {
+        fwrite(resp + 1, 1, len - 1, out);
+        free(resp);
+        *ret = 0;
+    } else {
+        memmove(resp, resp + 1, len);
+        ctx->error = resp;
+        *ret = -1;
+    }
+    return true;
+}
@@ -1,31 +1,399 @@
 #!/bin/bash
 
+# assert はケースを登録するだけで、最後の run_tests でまとめて確かめる。
+# 全ケースを並列にコンパイルし、各ケースの main を test_<番号> に改名して
+# 一つのプログラムにリンクするので、gcc -static のリンクは一回で済む。
+# --run の確認はケースごとに別のプロセスが要るので並列に実行する。
+
+tmp=tmp-test
+jobs=$(nproc)
+expects=()
+inputs=()
+pgo_expects=()
+pgo_inputs=()
+timing_expects=()
+timing_inputs=()
+vec_expects=()
+vec_inputs=()
+
 assert() {
-    expected="$1"
-    input="$2"
+    expects+=("$1")
+    inputs+=("$2")
+}
+
+# --profile-generate で集めたプロファイルを --profile-use に渡しても
+# 結果が変わらないことを確かめる
+assert_pgo() {
+    pgo_expects+=("$1")
+    pgo_inputs+=("$2")
+}
 
-    ./9cc <(echo "$input") > tmp.s
+# 各ケースを $tmp/<番号>.o にし、test_<番号> 以外のシンボルを隠す
+compile_case() {
+    ./9cc $tmp/$1.c > $tmp/$1.s &&
+        gcc -c -Wa,--noexecstack -o $tmp/$1.o $tmp/$1.s &&
+        objcopy --redefine-sym main=test_$1 -G test_$1 $tmp/$1.o
+}
 
-    if [ "$?" = 1 ]; then
-        echo 'compile error'
-        exit 1;
-    fi
-    gcc -static -o tmp tmp.s
-    ./tmp
-    actual="$?"
+# $2 は最適化のオプション
+jit_case() {
+    ./9cc --run $2 $tmp/$1.c > /dev/null
+    echo $? > $tmp/$1.jit$2
+}
+
+export tmp
+export -f compile_case jit_case
 
-    if [ "$actual" = "$expected" ]; then
-        echo "$input => $expected"
+check() {
+    local i=$1 actual=$2 how=$3
+    if [ "$actual" = "${expects[$i]}" ]; then
+        [ -z "$how" ] && echo "${inputs[$i]} => ${expects[$i]}"
     else
-        echo "$input => $expected expected, but got $actual"
-        exit 1;
+        echo "${inputs[$i]} => ${expects[$i]} expected, but got $actual$how"
+        exit 1
+    fi
+}
+
+# --time-functions を付けても結果が変わらず、main の行が出ることを確かめる
+assert_timing() {
+    timing_expects+=("$1")
+    timing_inputs+=("$2")
+}
+
+timing_case() {
+    local i=$1 src=$tmp/timing_$1.c actual
+    local expected=${timing_expects[$1]} input=${timing_inputs[$1]}
+    echo "$input" > $src
+
+    ./9cc --time-functions $src > $tmp/timing.s
+    gcc -static -Wa,--noexecstack -o $tmp/timing $tmp/timing.s || exit 1
+    for how in "" " with --run"; do
+        if [ -z "$how" ]; then
+            ./$tmp/timing > /dev/null 2> $tmp/timing.txt
+        else
+            ./9cc --run --time-functions $src > /dev/null 2> $tmp/timing.txt
+        fi
+        actual=$?
+        if [ "$actual" != "$expected" ] || ! grep -q '^main  *1 calls' $tmp/timing.txt; then
+            echo "$input => $expected expected, but got $actual with --time-functions$how"
+            exit 1
+        fi
+    done
+    echo "$input => $expected (timing)"
+}
+
+pgo_case() {
+    local i=$1 src=$tmp/pgo_$1.c prof=$tmp/pgo_$1.prof actual
+    local expected=${pgo_expects[$1]} input=${pgo_inputs[$1]}
+    echo "$input" > $src
+
+    for how in generate use; do
+        if [ $how = generate ]; then
+            ./9cc --profile-generate=$prof $src > $tmp/pgo.s
+        else
+            ./9cc --profile-use=$prof $src > $tmp/pgo.s
+        fi
+        gcc -static -Wa,--noexecstack -o $tmp/pgo $tmp/pgo.s || exit 1
+        ./$tmp/pgo > /dev/null
+        actual=$?
+        if [ "$actual" != "$expected" ]; then
+            echo "$input => $expected expected, but got $actual with --profile-$how"
+            exit 1
+        fi
+    done
+
+    ./9cc --run --profile-use=$prof $src > /dev/null
+    actual=$?
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expected, but got $actual with --run --profile-use"
+        exit 1
+    fi
+    echo "$input => $expected (pgo)"
+}
+
+# --vectorize で SSE2 の命令を使い、結果が変わらないことを確かめる
+assert_vec() {
+    vec_expects+=("$1")
+    vec_inputs+=("$2")
+}
+
+vec_case() {
+    local i=$1 src=$tmp/vec_$1.c actual
+    local expected=${vec_expects[$1]} input=${vec_inputs[$1]}
+    echo "$input" > $src
+
+    ./9cc --vectorize $src > $tmp/vec.s
+    if ! grep -q 'padd\|psub\|movdqu' $tmp/vec.s; then
+        echo "$input => not vectorized"
+        exit 1
     fi
+    gcc -static -Wa,--noexecstack -o $tmp/vec $tmp/vec.s || exit 1
+    for how in "" " with --run"; do
+        if [ -z "$how" ]; then
+            ./$tmp/vec > /dev/null
+        else
+            ./9cc --run --vectorize $src > /dev/null
+        fi
+        actual=$?
+        if [ "$actual" != "$expected" ]; then
+            echo "$input => $expected expected, but got $actual with --vectorize$how"
+            exit 1
+        fi
+    done
+    echo "$input => $expected (vectorize)"
+}
+
+# compile() を複数のスレッドから同時に呼んでも、コマンドラインで
+# コンパイルしたものと同じアセンブリが出て、エラーは戻り値で返ることを
+# 確かめる。各ケースの $tmp/<番号>.s を使う
+api_test() {
+    cat > $tmp/api.c <<'EOF'
+#include "../9cc.h"
+#include <pthread.h>
+
+#define THREADS 8
+
+static int n;
+static char **srcs;
+static char **expected;
+
+static char *read_all(char *path) {
+    FILE *fp = fopen(path, "r");
+    char *buf = NULL;
+    size_t cap = 0;
+    if (!fp || getdelim(&buf, &cap, '\0', fp) < 0)
+        error("cannot read %s", path);
+    fclose(fp);
+    return buf;
 }
 
+static void *worker(void *arg) {
+    long id = (long)arg;
+    Context ctx;
+    init_context(&ctx);
+    for (int k = 0; k < n; k++) {
+        // スレッドごとに順番を変える
+        int i = (k + id * 7) % n;
+        char *buf;
+        size_t len;
+        FILE *out = open_memstream(&buf, &len);
+        if (compile(&ctx, srcs[i], out))
+            error("case %d: %s", i, ctx.error);
+        fclose(out);
+        if (strcmp(buf, expected[i]))
+            error("case %d: thread %ld の出力が違います", i, id);
+        free(buf);
+
+        // 途中で失敗しても次のコンパイルに影響しない
+        if (k % 16 == 0) {
+            if (!compile(&ctx, "int main() { return x; }", stdout) ||
+                    !strstr(ctx.error, "undefined variable"))
+                error("エラーが返りません");
+            free(ctx.error);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    n = atoi(argv[2]);
+    srcs = calloc(n, sizeof(char *));
+    expected = calloc(n, sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        char path[256];
+        sprintf(path, "%s/%d.c", argv[1], i);
+        srcs[i] = read_all(path);
+        sprintf(path, "%s/%d.s", argv[1], i);
+        expected[i] = read_all(path);
+    }
+
+    pthread_t th[THREADS];
+    for (long i = 0; i < THREADS; i++)
+        pthread_create(&th[i], NULL, worker, (void *)i);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(th[i], NULL);
+    return 0;
+}
+EOF
+    gcc -std=c11 -pthread -o $tmp/api $tmp/api.c $(ls *.o | grep -v '^9cc\.o$') -ldl || exit 1
+    if ! ./$tmp/api $tmp ${#inputs[@]}; then
+        echo "compile() from threads failed"
+        exit 1
+    fi
+    echo "compile() from threads => OK (api)"
+}
+
+# --server で立てたサーバを NINECC_SOCKET で使っても、各ケースで
+# 同じアセンブリが出て、エラーも同じように出ることを確かめる
+server_test() {
+    ./9cc --server=$tmp/sock &
+    local pid=$! status
+    for _ in $(seq 50); do
+        [ -S $tmp/sock ] && break
+        sleep 0.1
+    done
+
+    for i in "${!inputs[@]}"; do
+        if ! NINECC_SOCKET=$tmp/sock ./9cc $tmp/$i.c | cmp -s - $tmp/$i.s; then
+            echo "${inputs[$i]} => different output with NINECC_SOCKET"
+            kill $pid
+            exit 1
+        fi
+    done
+    echo 'int main() { return x; }' > $tmp/server_err.c
+    NINECC_SOCKET=$tmp/sock ./9cc $tmp/server_err.c 2> $tmp/server_err.txt
+    status=$?
+    if ! kill $pid; then
+        echo "compile server died"
+        exit 1
+    fi
+    if [ $status != 1 ] || ! grep -q 'undefined variable' $tmp/server_err.txt; then
+        echo "compile error is not reported with NINECC_SOCKET"
+        exit 1
+    fi
+    echo "compile server => OK (server)"
+}
+
+run_tests() {
+    local n=${#inputs[@]}
+    rm -rf $tmp
+    mkdir -p $tmp
+    for i in "${!inputs[@]}"; do
+        echo "${inputs[$i]}" > $tmp/$i.c
+    done
+
+    if ! seq 0 $((n - 1)) | xargs -P$jobs -I{} bash -c 'compile_case {}'; then
+        echo 'compile error'
+        exit 1
+    fi
+
+    {
+        echo '#include <stdio.h>'
+        for i in "${!inputs[@]}"; do
+            echo "int test_$i(void);"
+        done
+        echo 'int main(int argc, char **argv) {'
+        echo '    FILE *out = fopen(argv[1], "w");'
+        for i in "${!inputs[@]}"; do
+            echo "    fprintf(out, \"%d\\n\", test_$i() & 255); fflush(out);"
+        done
+        echo '    return 0;'
+        echo '}'
+    } > $tmp/driver.c
+    gcc -static -o $tmp/test $tmp/driver.c $tmp/*.o || exit 1
+    ./$tmp/test $tmp/results > /dev/null
+
+    mapfile -t results < $tmp/results
+    for i in "${!inputs[@]}"; do
+        # 結果はケースごとに書き出しているので、途中で落ちたときは
+        # 最初に結果のないケースが原因
+        if [ $i -ge ${#results[@]} ]; then
+            check $i "crashed" ""
+        fi
+        check $i "${results[$i]}" ""
+    done
+
+    # 最適化のレベルを変えても結果は同じ
+    for opt in "" -O0 -O1; do
+        seq 0 $((n - 1)) | xargs -P$jobs -I{} bash -c "jit_case {} $opt"
+        for i in "${!inputs[@]}"; do
+            check $i "$(cat $tmp/$i.jit$opt)" " with --run${opt:+ $opt}"
+        done
+    done
+
+    for i in "${!pgo_inputs[@]}"; do
+        pgo_case $i
+    done
+    for i in "${!timing_inputs[@]}"; do
+        timing_case $i
+    done
+    for i in "${!vec_inputs[@]}"; do
+        vec_case $i
+    done
+    api_test
+    server_test
+
+    rm -rf $tmp
+    echo OK
+}
+
+assert_pgo 47 'int f(int x) { if (x == 0) return 1; else return 2; } int main() { int s=0; int i; for (i=0; i<100; i=i+1) { if (i == 50) s = s + 100; else s = s + f(i); } return s - 250; }'
+assert_pgo 10 'int main() { int n=0; int i=0; while (i<100) { i=i+1; if (i-i/10*10 == 0) n=n+1; } return n; }'
+assert_timing 55 'int main() { return fib(10); } int fib(int n) { if (n<2) return n; return fib(n-1) + fib(n-2); }'
+assert_vec 236 'int main() { char a[37]; char b[37]; char c[37]; int x[9]; int y[9]; int i; int s=0; int n=37; for (i=0; i<n; i=i+1) { b[i]=i*7; c[i]=i+100; } for (i=0; i<n; i=i+1) a[i] = b[i] + c[i]; for (i=0; i<n; i=i+1) s = s + a[i]; for (i=0; i<9; i=i+1) x[i] = i*i; for (i=0; i<=8; i=i+1) y[i] = x[i] - i; int t=0; for (i=0; i<9; i=i+1) t = y[i] + t; return s + t; }'
+assert_vec 36  'int main() { int y[9]; int i; for (i=0; i<9; i=i+1) y[i]=i; int t=0; for (i=0; i<9; i=i+1) t = y[i] + t; return t; }'
+assert_vec 32  'int main() { int a[20]; int i; for (i=0; i<20; i=i+1) a[i]=1; int *p=a; int *q=a+1; for (i=0; i<19; i=i+1) q[i] = p[i] + p[i]; return a[5]; }'
+assert_vec 40  'int main() { int a[7]; int b[7]; int c[7]; int i; for (i=0; i<7; i=i+1) { b[i]=i*10; c[i]=i*3; } for (i=2; i<=6; i=i+1) a[i] = b[i] - c[i]; for (i=0; i<7; i=i+1) b[i] = a[i]; return b[5] + i - 2; }'
+assert_pgo 5  'int main() { int i; int s=0; for (i=0; i<1000; i=i+1) { if (i == 700) break; s=s+1; } return s - 700 + 5; }'
+assert_pgo 35 'int main() { int i; int n=0; for (i=0; i<100; i=i+1) { if (i-i/3*3 == 0 && i != 50 || i == 1) n=n+1; } return n; }'
+
+assert 47  'int f(int k){int s=0;int i=0;switch(k){case 0: for(i=0;i<8;i=i+1){s=s+1; case 1: s=s+2;}} return s;} int main(){return f(0)+f(1);}'
+assert 32  'int f(int k){int a[8];int s=0;int i=0;int j;for(j=0;j<8;j=j+1)a[j]=j*10;switch(k){case 0: for(i=0;i<8;i=i+1){s=s+a[i]; case 1: s=s+1;}} return s;} int main(){return f(1);}'
+assert 139 'int main() { int a; int b; a = b = 3 + 4 * 2 - 1; return (20 - 5 - 3 * 2 / 3 - 1) * 10 + a + b - (3 > 2 == 1 + 1 > 1 && 2 >= 2 != 0 || 0); }'
+assert 62  'int main() { int x[3]; int *p = x; *p = 5; p[1] = -*p + 2 * 3; x[2] = !x[1] + !!p + -(-2); return x[0] * 10 + x[1] * 10 + x[2] - (p + 2 - x > 1 == 1); }'
+assert 212 'int g[6]; char h[6]; int main() { int m[3][2]; int i; int j; for (i=0; i<3; i=i+1) for (j=0; j<2; j=j+1) m[i][j]=i*2+j; int *p=g+3; p[-1]=7; *(p+2)=9; g[0]=g[2]+g[5]; h[4]=100; h[h[4]-97]=h[4]+20; int k=2; return g[0] + *(p-3) + (p-1)[0] + m[2][1]*10 + m[k][0] + h[3] - (g[k] == g[2]) - (h[4] < g[0]); }'
+assert 3   'int main() { return cnt("abcabca", 7, 97); } int cnt(char *s, int n, int c) { int k=0; int i; for (i=0; i<n; i=i+1) if (s[i]==c) k=k+1; return k; }'
+assert 32  'int main() { int a[4]; a[0]=2; a[1]=3; a[2]=4; a[3]=5; return dot(a, a+1, 3) - a[3]*a[1] - 1; } int dot(int *x, int *y, int n) { int s=0; int i; for (i=0; i<n; i=i+1) s = s + x[i]*y[i]; return s + *x * *(y+2); }'
+
+assert 160 'int z; int t() { z=z+1; return 1; } int f() { z=z+100; return 0; } int main() { int a=3; int b=0; int r=0; if (a && b) r=r+1; if (a || b) r=r+2; if (!b) r=r+4; if (!(a<2) && (b==0 || f())) r=r+8; r = r + (a && 5)*16 + (b || 0)*32 + !a*64 + !!a*128; z=0; int x = f() && t(); int y = t() || f(); return r + (z==101) + x*1000 + y; }'
+assert 80  'int main() { int a[10]; int i; for (i=0; i<10; i=i+1) a[i]=i; i=0; while (i<10 && a[i]!=7) i=i+1; int k=i; int n=0; for (i=0; i<10 && !(a[i]==5); i=i+1) n=n+1; return k*10+i+n; }'
+assert 6   'int main() { int *p=0; int x=5; if (p && *p) return 1; if (!p || *p) x=x+1; return x; }'
+assert 13  'int main() { int a=2; int b=3; int c=0; int x = a*b; int y = c && a*b; int z = a*b + (c || (a*b==6)); return x+y+z; }'
+assert 12  'int main() { int a=2; int b=3; int c=0; int y = c && (a*b+1); return y + a*b + a*b; }'
+
+assert 242 'int f(int x) { switch (x) { case 0: return 10; case 1: return 11; case 2: return 12; case 3: case 4: return 34; case 6: return 16; default: return 99; } } int main() { return f(0)+f(3)+f(9)+f(-1); }'
+assert 209 'int g(int x) { int r=0; switch (x) { case -100: r=1; break; case 7: r=2; break; case 1000: r=3; case 50000: r=r+4; break; default: r=6; } return r; } int main() { return g(-100)*1 + g(7)*10 + g(1000)*100 + g(50000)*1000 + g(5)*10000; }'
+assert 80  'int h(int x) { switch (x) { case 1: return 1; case 10: return 2; case 100: return 3; case 1000: return 4; case 10000: return 5; case 100000: return 6; case 3000000000: return 7; } return 0; } int main() { return h(1)+h(100)+h(100000)+h(3000000*1000)*10+h(5); }'
+assert 134 'int main() { int s=0; int i; for (i=0; i<6; i=i+1) { switch (i) { default: s=s+1; break; case 2: switch (i*2) { case 4: s=s+10; break; case 5: s=s+1000; } s=s+20; break; case 5: s=s+100; } } return s; }'
+assert 105 'int main() { int i; int n=0; for (i=0; i<100; i=i+1) { if (i==10) break; n=n+1; } int w=0; while (1) { w=w+1; switch (w) { case 3: break; } if (w==5) break; } return n*10 + w; }'
+assert 78  'int main() { int a[10]; int i; for (i=0; i<10; i=i+1) a[i]=i*3; for (i=0; i<10; i=i+1) { if (a[i] > 15) break; } return i*10 + a[i]; }'
+assert 36  'int main() { int a=3; int b=4; int x=a*b; switch (a) { case 3: x=x+a*b; } return x+a*b; }'
+
+assert 15  'int main() { int x[5]; x[0]=1; x[1]=2; x[2]=3; x[3]=4; x[4]=5; return sum(x, 5); } int sum(int *a, int n) { int s=0; int i; for (i=0; i<n; i=i+1) s=s+a[i]; return s; }'
+assert 98  'int main() { int a[8]; int i; for (i=0; i<8; i=i+1) a[i]=i; return a[0]*1+a[1]*2+a[2]*4+a[3]*8+a[4]*16; }'
+assert 30  'int main() { int a[10]; int b[10]; int i; for (i=0; i<10; i=i+2) { a[i]=i; b[i]=a[i]*2; } return b[8]+b[6]+b[4]+b[2]-i; }'
+assert 56  'int main() { char s[4]; int i; for (i=0; i<4; i=i+1) s[i]=i+54; int n=3; for (i=0; i<n; i=i+1) if (i==1) n=2; return s[i]+i-2; }'
+assert 45  'int main() { int a[10]; int i; int j; for (i=0; i<10; i=i+1) for (j=0; j<=i; j=j+1) a[i]=j; int s=0; for (i=0; i<10; i=i+1) s=s+a[i]; return s; }'
+
+assert 78  'int main() { int s=0; int i; int n=7; for (i=0; i<n; i=i+1) s=s+i; int t=0; for (i=1; i<=8; i=i+1) t=t+i; return s*2+t; }'
+assert 15  'int main() { return f(0)+f(1)+f(3)+f(4)+f(5)-3; } int f(int n) { int c=0; int i; for (i=0; i<n; i=i+1) c=c+1; return c+1; }'
+assert 90  'int main() { int s=0; int i; int j; for (i=0; i<10; i=i+1) for (j=0; j<i; j=j+1) s=s+2; return s; }'
+assert 12  'int main() { int i; for (i=5; i<100; i=i+1) { if (i==12) return i; } return 0; }'
+assert 55  'int main() { char a[10]; int i; for (i=0; i<10; i=i+1) a[i]=i+1; int s=0; for (i=0; i<10; i=i+1) s=s+a[i]; return s; }'
+assert 6   'int main() { int i; int k=0; for (i=0; i<6; i=i+1) k=i; return k+1; }'
+
+assert 15  'int main() { int a[4]; int b[4]; int i; for (i=0; i<4; i=i+1) { a[i]=i; b[i]=i*2; } for (i=0; i<4; i=i+1) a[i] = a[i] + b[i]; return a[3] + a[2]; }'
+assert 29  'int main() { int a=2; int b=3; int x=a*b; a=a+1; int y=a*b; return x+y+(a*b)+(b*a)-4; }'
+assert 12  'int g; int main() { g=1; int x=g*2+1; f(); return x+(g*2+1); } int f() { g=4; return 0; }'
+assert 7   'int main() { char s[3]; int i=1; s[i]=3; s[i]=s[i]+4; return s[i]; }'
+assert 8   'int main() { int x[2]; int *p=x; int i=0; p[i]=5; x[i]=x[i]+3; return p[i]; }'
+
+assert 45  'int main() { int s=0; int i; for (i=0; i<10; i=i+1) s=s+i; return s; }'
+assert 3   'int main() { char c=130; char d=c+129; return d; }'
+assert 21  'int main() { int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; return a+b+c+d+e+f; }'
+assert 18  'int main() { int a=1; int b=2; int c=3; return f(a,b,c)+a+b+c+f(c,b,a); } int f(int x, int y, int z) { int t=x*100+y*10+z; return t-t+x+y+z+x*y*z-6+6*x-6*x; }'
+assert 15  'int main() { int s=0; int i; for (i=1; i<=5; i=i+1) s=s+g(i); return s; } int g(int n) { int k=n; return h(k, 0); } int h(int n, int acc) { if (n==0) return acc; return 1+h(n-1, acc); }'
+
+assert 1   'int main() { int a=1; int b=2; return a-(b-(a-(b-(a*(b+a))))); }'
+assert 2   'int main() { int a=3; int b=4; return (a+b+1)/(b-(a-(b-(a-1)))); }'
+assert 1   'int main() { int a[3]; int *p=a; a[2]=7; return p+2-(p+(1-(1-1))); }'
+assert 21  'int x; int main() { x=1; return x*10+(x+(f()+(x*1))); } int f() { x=9; return 1; }'
+
+assert 7   'char c; int x; int y[10]; int main() { c=3; x=4; y[9]=c+x; return y[9]; }'
+assert 5   'int main() { char c; int x; char d; c=2; x=3; d=c+x; return d; }'
+assert 7   'int main() { return abs(0-7); }'
+assert 1   'int main() { return "abc" == "abc"; }'
+assert 1   'int main() { return "abc" + 1 == "bc"; }'
+assert 98  'int main() { char *p="bc"; char *q="abc"; return p[0]; }'
+assert 121 'int main() { return "x\0y"[2]; }'
+assert 32  'int main() { return sum(1000000, 0); } int sum(int n, int acc) { if (n==0) return acc; return sum(n-1, acc+n); }'
+assert 1   'int main() { return even(1000000); } int even(int n) { if (n==0) return 1; return odd(n-1); } int odd(int n) { if (n==0) return 0; return even(n-1); }'
+assert 7   'int main() { int x=3; return get(&x, 4); } int get(int *p, int y) { return *p + y; }'
+assert 3   'int main() { int abcdefghijklmnopqrstuvwxyzABCDEFGHIJ0123456789=3; /* * ** / */ return abcdefghijklmnopqrstuvwxyzABCDEFGHIJ0123456789; }'
+assert 92  'int main() { return "                   \\\"                              "[19]; }'
 assert 2   'int main() { /** return 1; **/ return 2;}'
 assert 2   'int main() { // return 2;
 return 2;}';
-exit;
 assert 7   'int main() { return "\a"[0]; }'
 assert 8   'int main() { return "\b"[0]; }'
 assert 9   'int main() { return "\t"[0]; }'
@@ -169,4 +537,4 @@ assert 3   'int main() { return 1 + 1 + 1; }'
 assert 21  'int main() { return 5 + 20 - 4; }'
 assert 0   'int main() { return 0;}'
 assert 43  'int main() { return 43;}'
-echo OK
+run_tests
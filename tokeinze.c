@@ -1,18 +1,106 @@
 #include "9cc.h"
 
-char *user_input;
-char *filename;
-Token *token;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+_Thread_local char *user_input;
+_Thread_local char *filename;
+_Thread_local Token token;
+_Thread_local jmp_buf *error_jmp;
+_Thread_local char *error_msg;
+
+// トークンは必要になった時に一つずつ読み、このリングバッファに置く。
+// is_function() の先読みはたかだか数トークンしか戻らないので、
+// 直近 TOKEN_RING 個だけ残っていれば十分。
+#define TOKEN_RING 256
+
+// 種別・ソース上の位置・長さ・記号の番号を 8 バイトに詰めたもの
+typedef struct {
+    uint32_t pos; // user_input からのオフセット
+    uint32_t len : 20;
+    uint32_t kind : 4;
+    uint32_t id : 8; // TK_RESERVED のときの Reserved
+} TokenInfo;
+
+static _Thread_local TokenInfo tokens[TOKEN_RING];
+static _Thread_local Token last_tok; // 最後に読んだトークンの番号
+static _Thread_local char *lex_pos; // 次に読むソース上の位置
+
+// 文字列リテラルの中身はトークン本体とは別に持つ
+static _Thread_local char *str_contents[TOKEN_RING];
+static _Thread_local int str_len[TOKEN_RING];
+
+static void read_token();
+
+static char *reserved_str[NUM_RESERVED] = {
+    [PU_ADD] = "+", [PU_SUB] = "-", [PU_MUL] = "*", [PU_DIV] = "/",
+    [PU_LPAREN] = "(", [PU_RPAREN] = ")", [PU_LT] = "<", [PU_GT] = ">",
+    [PU_SEMICOLON] = ";", [PU_ASSIGN] = "=", [PU_LBRACE] = "{",
+    [PU_RBRACE] = "}", [PU_COMMA] = ",", [PU_AMP] = "&",
+    [PU_LBRACKET] = "[", [PU_RBRACKET] = "]",
+    [PU_EQ] = "==", [PU_NE] = "!=", [PU_LE] = "<=", [PU_GE] = ">=",
+    [PU_COLON] = ":", [PU_NOT] = "!", [PU_LOGAND] = "&&", [PU_LOGOR] = "||",
+    [KW_RETURN] = "return", [KW_IF] = "if", [KW_ELSE] = "else",
+    [KW_WHILE] = "while", [KW_FOR] = "for", [KW_INT] = "int",
+    [KW_SIZEOF] = "sizeof", [KW_CHAR] = "char", [KW_SWITCH] = "switch",
+    [KW_CASE] = "case", [KW_DEFAULT] = "default", [KW_BREAK] = "break",
+};
+
+
+static int slot(Token tok) {
+    if (tok + TOKEN_RING <= last_tok)
+        error("トークンの先読みが長すぎます");
+    return tok % TOKEN_RING;
+}
+
+TokenKind tok_kind(Token tok) {
+    return tokens[slot(tok)].kind;
+}
+
+char *tok_str(Token tok) {
+    return user_input + tokens[slot(tok)].pos;
+}
+
+int tok_len(Token tok) {
+    return tokens[slot(tok)].len;
+}
+
+char *tok_contents(Token tok) {
+    return str_contents[slot(tok)];
+}
+
+int tok_cont_len(Token tok) {
+    return str_len[slot(tok)];
+}
+
+// メッセージを書き終えたら、compile() の中ならそこへ戻り、
+// そうでなければ表示して終了する
+static _Noreturn void raise_error(FILE *fp, char **buf) {
+    fclose(fp);
+    if (error_jmp) {
+        error_msg = *buf;
+        longjmp(*error_jmp, 1);
+    }
+    fputs(*buf, stderr);
+    exit(1);
+}
 
 void error(char *fmt, ...) {
+    char *buf;
+    size_t len;
+    FILE *fp = open_memstream(&buf, &len);
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    vfprintf(fp, fmt, ap);
+    fprintf(fp, "\n");
+    raise_error(fp, &buf);
 }
 
 static void verror_at(char *loc, char *fmt, va_list ap) {
+    char *buf;
+    size_t len;
+    FILE *fp = open_memstream(&buf, &len);
 
     char *line = loc;
     while (user_input < line && line[-1] != '\n')
@@ -27,15 +115,15 @@ static void verror_at(char *loc, char *fmt, va_list ap) {
         if (*p == '\n')
             line_num++;
 
-    int indent = fprintf(stderr, "%s:%d: ", filename, line_num);
-    fprintf(stderr, "%.*s\n", (int)(end - line), line);
+    int indent = fprintf(fp, "%s:%d: ", filename, line_num);
+    fprintf(fp, "%.*s\n", (int)(end - line), line);
 
     int pos = loc - line + indent;
-    fprintf(stderr, "%s\n", user_input);
-    fprintf(stderr, "%*s^ ", pos, "");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    fprintf(fp, "%s\n", user_input);
+    fprintf(fp, "%*s^ ", pos, "");
+    vfprintf(fp, fmt, ap);
+    fprintf(fp, "\n");
+    raise_error(fp, &buf);
 }
 
 void error_at(char *loc, char *fmt, ...) {
@@ -44,88 +132,227 @@ void error_at(char *loc, char *fmt, ...) {
     verror_at(loc, fmt, ap);
 }
 
-void error_tok(Token *tok, char *fmt, ...) {
+void error_tok(Token tok, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    verror_at(tok->str, fmt, ap);
+    verror_at(tok_str(tok), fmt, ap);
 }
 
-Token *consume(char *op) {
-    if (token->kind != TK_RESERVED || 
-        strlen(op) != token->len ||
-        memcmp(token->str, op, token->len))
-        return NULL;
-    Token *t = token;
-    token = token->next;
+// 現在のトークンを返して次のトークンへ進む
+Token advance() {
+    Token t = token;
+    if (t == last_tok)
+        read_token();
+    token = t + 1;
     return t;
 }
 
-Token *peek(char *s) {
-    if (token->kind != TK_RESERVED || strlen(s) != token->len ||
-            strncmp(token->str, s, token->len))
+// 記号か予約語ならその番号、そうでなければ PU_NONE
+Reserved tok_reserved(Token tok) {
+    TokenInfo *info = &tokens[slot(tok)];
+    return info->kind == TK_RESERVED ? info->id : PU_NONE;
+}
+
+static bool equal(Token tok, Reserved op) {
+    return tok_kind(tok) == TK_RESERVED && tokens[slot(tok)].id == op;
+}
+
+// op を読み進めてその位置を返す。トークン自体はリングバッファから
+// 消えることがあるので、後で使う位置は文字列上のポインタで持つ。
+char *consume(Reserved op) {
+    if (!equal(token, op))
         return NULL;
+    return tok_str(advance());
+}
+
+Token peek(Reserved op) {
+    if (!equal(token, op))
+        return 0;
     return token;
 }
 
-Token *consume_ident() {
-    if (token->kind != TK_INDENT)
-        return NULL;
-    Token *t = token;
-    token = token->next;
-    return t;
+Token consume_ident() {
+    if (tok_kind(token) != TK_INDENT)
+        return 0;
+    return advance();
 }
 
 long expect_number() {
-    if (token->kind != TK_NUM)
+    if (tok_kind(token) != TK_NUM)
         error_tok(token, "数値ではありません");
-    long val = token->val;
-    token = token->next;
+    long val = strtol(tok_str(token), NULL, 10);
+    advance();
     return val;
 }
 
 char *expect_ident() {
-    if (token->kind != TK_INDENT)
+    if (tok_kind(token) != TK_INDENT)
         error_tok(token, "識別子ではありません");
-    char *s = strndup(token->str, token->len);
-    token = token->next;
+    char *s = arena_strndup(tok_str(token), tok_len(token));
+    advance();
     return s;
 }
 
 
-void expect(char *op) {
+void expect(Reserved op) {
     if (!peek(op))
-        error_tok(token, "'%s'ではありません", op);
-    token = token->next;
+        error_tok(token, "'%s'ではありません", reserved_str[op]);
+    advance();
 }
 
 
-static Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-    Token *tok = calloc(1, sizeof(Token));
-    tok->kind = kind;
-    tok->str = str;
-    tok->len = len;
-    cur->next = tok;
+static Token new_token(TokenKind kind, char *str, int len) {
+    if (len >= 1 << 20)
+        error_at(str, "トークンが長すぎます");
+    Token tok = ++last_tok;
+    TokenInfo *info = &tokens[tok % TOKEN_RING];
+    info->kind = kind;
+    info->pos = str - user_input;
+    info->len = len;
+    info->id = PU_NONE;
     return tok;
 }
 
+static void new_reserved(Reserved op, char *str, int len) {
+    Token tok = new_token(TK_RESERVED, str, len);
+    tokens[tok % TOKEN_RING].id = op;
+}
+
 bool startswith(char *p, char *q) {
     return memcmp(p, q, strlen(q)) == 0;
 }
 
 bool at_eof() {
-    return token->kind == TK_EOF;
+    return tok_kind(token) == TK_EOF;
 }
 
-static char *starts_with_reserved(char *p) {
-    static char *kw[] = {"return", "if", "else", "while", "for", "int", "sizeof", "char"};
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++) {
-        int len = strlen(kw[i]);
-        if (startswith(p, kw[i]) && !isalnum(p[len])) {
-            return kw[i];
-        }
+// 1文字の記号は文字で引く表、2文字の記号と予約語は完全ハッシュで引く。
+// ハッシュが衝突しないことは表を作るときに確かめる。
+// 表はスレッドごとに最初の tokenize で作る。
+static _Thread_local unsigned char punct1[256];
+static _Thread_local unsigned char punct2[16];
+static _Thread_local unsigned char keywords[32];
+
+static int hash_punct2(char *p) {
+    return (p[0] * 5 + p[1]) & 15;
+}
+
+static int hash_keyword(char *p, int len) {
+    return (len + p[0] * 5 + p[len - 1]) & 31;
+}
+
+static void init_reserved() {
+    for (int i = PU_NONE + 1; i < NUM_RESERVED; i++) {
+        char *s = reserved_str[i];
+        int len = strlen(s);
+        unsigned char *slot;
+        if (isalpha(*s))
+            slot = &keywords[hash_keyword(s, len)];
+        else if (len == 2)
+            slot = &punct2[hash_punct2(s)];
+        else
+            slot = &punct1[(unsigned char)*s];
+        if (*slot)
+            error("予約語のハッシュが衝突しています: %s", s);
+        *slot = i;
     }
+}
 
-    return NULL;
+static Reserved find_punct2(char *p) {
+    Reserved op = punct2[hash_punct2(p)];
+    if (op && !memcmp(reserved_str[op], p, 2))
+        return op;
+    return PU_NONE;
+}
+
+static Reserved find_keyword(char *p, int len) {
+    Reserved op = keywords[hash_keyword(p, len)];
+    if (op && strlen(reserved_str[op]) == len && !memcmp(reserved_str[op], p, len))
+        return op;
+    return PU_NONE;
+}
+
+// 空白・識別子・コメントや文字列の終端を探す走査。
+// SSE2 が使えるときは 16 バイトずつまとめて分類する。
+#ifdef __SSE2__
+
+// アラインされた 16 バイトの読み込みはページ境界をまたがないので、
+// 終端の '\0' を含むブロックまで読んでも範囲外のページには触れない。
+static __m128i load16(char *p) {
+    return _mm_load_si128((__m128i *)p);
+}
+
+static __m128i in_range(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static __m128i is_byte(__m128i v, char c) {
+    return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+
+// 走査を止めるバイトの位置を 16 ビットのマスクで返す
+static int stop_mask(__m128i v, int cls, char c) {
+    __m128i m;
+    switch (cls) {
+        case 0: // 空白以外で止まる
+            m = _mm_or_si128(is_byte(v, ' '), in_range(v, '\t', '\r'));
+            return ~_mm_movemask_epi8(m) & 0xffff;
+        case 1: // 英数字以外で止まる
+            m = _mm_or_si128(in_range(v, '0', '9'),
+                    _mm_or_si128(in_range(v, 'A', 'Z'), in_range(v, 'a', 'z')));
+            return ~_mm_movemask_epi8(m) & 0xffff;
+        default: // c か '\0' で止まる
+            m = _mm_or_si128(is_byte(v, c), is_byte(v, '\0'));
+            if (c == '"')
+                m = _mm_or_si128(m, is_byte(v, '\\'));
+            return _mm_movemask_epi8(m);
+    }
+}
+
+static char *scan(char *p, int cls, char c) {
+    int off = (uintptr_t)p & 15;
+    char *base = p - off;
+    int mask = stop_mask(load16(base), cls, c) & (0xffff << off);
+    while (!mask) {
+        base += 16;
+        mask = stop_mask(load16(base), cls, c);
+    }
+    return base + __builtin_ctz(mask);
+}
+
+#else
+
+static char *scan(char *p, int cls, char c) {
+    switch (cls) {
+        case 0:
+            while (isspace(*p))
+                p++;
+            return p;
+        case 1:
+            while (isalnum(*p))
+                p++;
+            return p;
+        default:
+            while (*p && *p != c && !(c == '"' && *p == '\\'))
+                p++;
+            return p;
+    }
+}
+
+#endif
+
+static char *skip_space(char *p) {
+    return scan(p, 0, 0);
+}
+
+static char *skip_alnum(char *p) {
+    return scan(p, 1, 0);
+}
+
+// c か文字列の終端を探す。c が '"' のときは '\\' でも止まる。
+static char *find_char(char *p, char c) {
+    return scan(p, 2, c);
 }
 
 static char get_escape_char(char c) {
@@ -143,105 +370,119 @@ static char get_escape_char(char c) {
     }
 }
 
-static Token *read_string_literal(Token *cur, char *start) {
+static char *read_string_literal(char *start) {
     char *p = start + 1;
     char buf[1024];
     int len = 0;
 
     for (;;) {
-        if (len == sizeof(buf))
+        char *q = find_char(p, '"');
+        if (len + (q - p) >= sizeof(buf))
             error_at(start, "string literal too large");
-        if (*p == '\0')
+        memcpy(buf + len, p, q - p);
+        len += q - p;
+        p = q;
+
+        if (*p == '\0' || (*p == '\\' && p[1] == '\0'))
             error_at(start, "unclosed string literal");
         if (*p == '"')
             break;
 
-        if (*p == '\\') {
-            p++;
-            buf[len++] = get_escape_char(*p++);
-        } else {
-            buf[len++] = *p++;
-        }
+        p++;
+        buf[len++] = get_escape_char(*p++);
     }
 
-    Token *tok = new_token(TK_STR, cur, start, p - start + 1);
-    tok->contents = malloc(len + 1);
-    memcpy(tok->contents, buf, len);
-    tok->contents[len] = '\0';
-    tok->cont_len = len + 1;
-    return tok;
+    int i = new_token(TK_STR, start, p - start + 1) % TOKEN_RING;
+    str_contents[i] = arena_alloc(len + 1);
+    memcpy(str_contents[i], buf, len);
+    str_len[i] = len + 1;
+    return p + 1;
 }
 
-Token *tokenize(char *p) {
-    user_input = p;
-    Token head;
-    head.next = NULL;
-    Token *cur = &head;
+// 次のトークンを一つ読む
+static void read_token() {
+    char *p = lex_pos;
 
-    while (*p) {
+    for (;;) {
         if (isspace(*p)) {
-            p++;
-            continue;
-        }
-        if (isdigit(*p)) {
-            char *q = p;
-            cur = new_token(TK_NUM, cur, p, 0);
-            cur->val = strtol(p, &p, 10);
-            cur->len = p - q;
+            p = skip_space(p);
             continue;
         }
 
         if (startswith(p, "//")) {
-            p += 2;
-            while (*p != '\n')
-                p++;
+            p = find_char(p + 2, '\n');
             continue;
         }
 
         if (startswith(p, "/*")) {
-            char *q = strstr(p + 2, "*/");
-            if (!q)
-                error_at(p, "コメントが閉じられてません");
+            char *q = p + 2;
+            for (;;) {
+                q = find_char(q, '*');
+                if (!*q)
+                    error_at(p, "コメントが閉じられてません");
+                if (q[1] == '/')
+                    break;
+                q++;
+            }
             p = q + 2;
             continue;
         }
+        break;
+    }
 
-        if (startswith(p, "==") || startswith(p, "!=") || startswith(p, "<=") || startswith(p, ">=")) {
-            cur = new_token(TK_RESERVED, cur, p, 2);
-            p += 2;
-            continue;
-        }
-        if (strchr("+-*/()<>;={},*&[]", *p)) {
-            cur = new_token(TK_RESERVED, cur, p, 1);
-            cur->val = *p;
-            p++;
-            continue;
-        }
-        char *kw = starts_with_reserved(p);
-        if (kw) {
-            int len = strlen(kw);
-            cur = new_token(TK_RESERVED, cur, p, len);
-            p += len;
-            continue;
-        }
+    if (!*p) {
+        new_token(TK_EOF, p, 0);
+        lex_pos = p;
+        return;
+    }
 
-        if (*p == '"') {
-            cur = read_string_literal(cur, p);
-            p += cur->len;
-            continue;
-        }
+    if (isdigit(*p)) {
+        char *q = p;
+        strtol(p, &p, 10);
+        new_token(TK_NUM, q, p - q);
+        lex_pos = p;
+        return;
+    }
 
-        if (isalnum(*p)) {
-            char *q = p++;
-            while(isalnum(*p))
-                p++;
-            cur = new_token(TK_INDENT, cur, q, p - q);
-            continue;
-        }
+    Reserved op;
+    if ((op = find_punct2(p))) {
+        new_reserved(op, p, 2);
+        lex_pos = p + 2;
+        return;
+    }
+    if ((op = punct1[(unsigned char)*p])) {
+        new_reserved(op, p, 1);
+        lex_pos = p + 1;
+        return;
+    }
 
-        error_at(p, "予期しない文字列です");
+    if (*p == '"') {
+        lex_pos = read_string_literal(p);
+        return;
     }
-    new_token(TK_EOF, cur, p, 0);
-    return head.next;
+
+    if (isalnum(*p)) {
+        char *q = p;
+        p = skip_alnum(p + 1);
+        if ((op = find_keyword(q, p - q)))
+            new_reserved(op, q, p - q);
+        else
+            new_token(TK_INDENT, q, p - q);
+        lex_pos = p;
+        return;
+    }
+
+    error_at(p, "予期しない文字列です");
 }
 
+// 最初のトークンだけを読んでその番号を返す。
+// 残りは advance() が必要に応じて読む。
+Token tokenize(char *p) {
+    if (!punct1[';'])
+        init_reserved();
+    user_input = p;
+    lex_pos = p;
+    last_tok = 0;
+    read_token();
+    return last_tok;
+}
@@ -1,24 +1,26 @@
 #include "9cc.h"
 
-Type *int_type = &(Type){ TY_INT, 8 };
-Type *char_type = &(Type){ TY_CHAR, 1 };
+Type *int_type = &(Type){ TY_INT, 8, 8 };
+Type *char_type = &(Type){ TY_CHAR, 1, 1 };
 
 bool is_integer(Type *ty) {
     return ty->kind == TY_CHAR || ty->kind == TY_INT;
 }
 
 Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(sizeof(Type));
     ty->kind = TY_PTR;
     ty->size = 8;
+    ty->align = 8;
     ty->base = base;
     return ty;
 }
 
 Type *array_of(Type *base, int len) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(sizeof(Type));
     ty->kind = TY_ARRAY;
     ty->size = base->size * len;
+    ty->align = base->align;
     ty->base = base;
     ty->array_len = len;
     return ty;
@@ -28,18 +30,35 @@ void add_type(Node *node) {
     if (!node || node->ty)
         return;
 
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
-
-    for (Node *n = node->body; n; n = n->next)
-        add_type(n);
-    for (Node *n = node->args; n; n = n->next)
-        add_type(n);
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_VAR:
+        case ND_NULL:
+        case ND_BREAK:
+            break;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+        case ND_SWITCH:
+        case ND_CASE:
+            add_type(node->cond);
+            add_type(node->then);
+            add_type(node->els);
+            add_type(node->init);
+            add_type(node->inc);
+            break;
+        case ND_BLOCK:
+            for (Node *n = node->body; n; n = n->next)
+                add_type(n);
+            break;
+        case ND_FUNCALL:
+            for (Node *n = node->args; n; n = n->next)
+                add_type(n);
+            break;
+        default:
+            add_type(node->lhs);
+            add_type(node->rhs);
+    }
 
     switch (node->kind) {
         case ND_ADD:
@@ -51,6 +70,9 @@ void add_type(Node *node) {
         case ND_NE:
         case ND_LT:
         case ND_LE:
+        case ND_LOGAND:
+        case ND_LOGOR:
+        case ND_NOT:
         case ND_FUNCALL:
         case ND_NUM:
             node->ty = int_type;
@@ -71,7 +93,7 @@ void add_type(Node *node) {
             return;
         case ND_DEREF:
             if (!node->lhs->ty->base)
-                error_tok(node->tok, "無効なポインタ参照です");
+                error_at(node->loc, "無効なポインタ参照です");
             node->ty = node->lhs->ty->base;
             return;
         default:
@@ -0,0 +1,278 @@
+#include "9cc.h"
+
+// 回数の決まった for ループの展開。
+//
+//   for (init; i < n; i = i + 1) body
+//
+// の形で、body が i と n に代入しないループを
+//
+//   init;
+//   for (; i + (F-1) < n; i = i + 1) { body; i = i + 1; ... body }
+//   for (; i < n; i = i + 1) body
+//
+// にする。後ろのループは端数の分で、回数が F で割り切れると分かって
+// いれば出さない。i と n はアドレスを取られないローカル変数 (n は
+// 定数でもよい) に限るので、body の中の関数呼び出しでは変わらない。
+// 入れ子のループは一番内側だけを展開する。
+
+_Thread_local int unroll_factor;
+
+static _Thread_local int num_unrolled;
+
+// 展開した後の本体のノード数の上限
+#define MAX_UNROLLED_NODES 256
+
+static Node *copy_tree(Node *node);
+
+static Node *copy_list(Node *node) {
+    Node head = {};
+    Node *cur = &head;
+    for (; node; node = node->next) {
+        cur->next = copy_tree(node);
+        cur = cur->next;
+    }
+    return head.next;
+}
+
+static Node *copy_tree(Node *node) {
+    if (!node)
+        return NULL;
+
+    Node *copy = copy_node(node);
+    copy->next = NULL;
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_NULL:
+            break;
+        case ND_VAR:
+            node->var->refcnt++;
+            break;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+            copy->cond = copy_tree(node->cond);
+            copy->then = copy_tree(node->then);
+            copy->els = copy_tree(node->els);
+            copy->init = copy_tree(node->init);
+            copy->inc = copy_tree(node->inc);
+            break;
+        case ND_BLOCK:
+            copy->body = copy_list(node->body);
+            break;
+        case ND_FUNCALL:
+            copy->args = copy_list(node->args);
+            break;
+        default:
+            copy->lhs = copy_tree(node->lhs);
+            copy->rhs = copy_tree(node->rhs);
+            break;
+    }
+    return copy;
+}
+
+static int count_nodes(Node *node, Var *i, Var *n);
+
+static int count_list(Node *node, Var *i, Var *n) {
+    int cnt = 0;
+    for (; node; node = node->next) {
+        int c = count_nodes(node, i, n);
+        if (c < 0)
+            return -1;
+        cnt += c;
+    }
+    return cnt;
+}
+
+// body のノード数を数える。ループ、switch、case、break か i, n への代入が
+// あれば -1。case は外の switch から飛んでくるので複製できない
+static int count_nodes(Node *node, Var *i, Var *n) {
+    if (!node)
+        return 0;
+
+    Node *kids[3] = {};
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_VAR:
+        case ND_NULL:
+            return 1;
+        case ND_WHILE:
+        case ND_FOR:
+        case ND_SWITCH:
+        case ND_CASE:
+        case ND_BREAK:
+            return -1;
+        case ND_IF:
+            kids[0] = node->cond;
+            kids[1] = node->then;
+            kids[2] = node->els;
+            break;
+        case ND_BLOCK: {
+            int c = count_list(node->body, i, n);
+            return c < 0 ? -1 : c + 1;
+        }
+        case ND_FUNCALL: {
+            int c = count_list(node->args, i, n);
+            return c < 0 ? -1 : c + 1;
+        }
+        case ND_ASSIGN:
+            if (node->lhs->kind == ND_VAR &&
+                    (node->lhs->var == i || node->lhs->var == n))
+                return -1;
+            // fallthrough
+        default:
+            kids[0] = node->lhs;
+            kids[1] = node->rhs;
+            break;
+    }
+
+    int cnt = 1;
+    for (int k = 0; k < 3; k++) {
+        int c = count_nodes(kids[k], i, n);
+        if (c < 0)
+            return -1;
+        cnt += c;
+    }
+    return cnt;
+}
+
+static bool is_counter(Var *var) {
+    return var->is_local && !var->addr_taken && var->ty->kind == TY_INT;
+}
+
+// i = i + 1
+static bool is_increment(Node *inc, Var *i) {
+    if (!inc || inc->lhs->kind != ND_ASSIGN)
+        return false;
+    Node *assign = inc->lhs;
+    Node *add = assign->rhs;
+    return assign->lhs->kind == ND_VAR && assign->lhs->var == i &&
+        add->kind == ND_ADD && add->lhs->kind == ND_VAR && add->lhs->var == i &&
+        add->rhs->kind == ND_NUM && add->rhs->val == 1;
+}
+
+// init が i = 定数 で上限も定数なら回数を返す。分からなければ -1
+static long trip_count(Node *node, Var *i) {
+    Node *cond = node->cond;
+    if (!node->init || cond->rhs->kind != ND_NUM)
+        return -1;
+    Node *init = node->init->lhs;
+    if (init->kind != ND_ASSIGN || init->lhs->kind != ND_VAR ||
+            init->lhs->var != i || init->rhs->kind != ND_NUM)
+        return -1;
+
+    long n = cond->rhs->val - init->rhs->val + (cond->kind == ND_LE);
+    return n < 0 ? 0 : n;
+}
+
+static Node *unroll(Node *node) {
+    Node *cond = node->cond;
+    if (node->vec || !cond || (cond->kind != ND_LT && cond->kind != ND_LE) ||
+            cond->lhs->kind != ND_VAR || !is_counter(cond->lhs->var))
+        return NULL;
+    Var *i = cond->lhs->var;
+
+    Var *n = NULL;
+    if (cond->rhs->kind == ND_VAR) {
+        n = cond->rhs->var;
+        if (!n->is_local || n->addr_taken || n->ty->kind == TY_ARRAY)
+            return NULL;
+    } else if (cond->rhs->kind != ND_NUM) {
+        return NULL;
+    }
+
+    if (!is_increment(node->inc, i))
+        return NULL;
+    int size = count_nodes(node->then, i, n);
+    if (size < 0 || size * unroll_factor > MAX_UNROLLED_NODES)
+        return NULL;
+
+    long trip = trip_count(node, i);
+    if (trip >= 0 && trip < unroll_factor)
+        return NULL;
+
+    char *loc = node->loc;
+
+    // 本体: F 回分の body の間に i = i + 1 を挟む
+    Node head = {};
+    Node *cur = &head;
+    for (int k = 0; k < unroll_factor; k++) {
+        if (k > 0) {
+            cur->next = copy_tree(node->inc);
+            cur = cur->next;
+        }
+        cur->next = copy_tree(node->then);
+        cur = cur->next;
+    }
+    Node *body = new_node(ND_BLOCK, loc);
+    body->body = head.next;
+
+    Node *main_cond = copy_tree(cond);
+    main_cond->lhs = new_binary(ND_ADD, main_cond->lhs,
+                                new_num(unroll_factor - 1, loc), loc);
+    add_type(main_cond->lhs);
+
+    Node *loop = new_node(ND_FOR, loc);
+    loop->cond = main_cond;
+    loop->then = body;
+    loop->inc = copy_tree(node->inc);
+
+    Node *init = node->init;
+    node->init = NULL;
+
+    Node *block = new_node(ND_BLOCK, loc);
+    if (init) {
+        block->body = init;
+        init->next = loop;
+    } else {
+        block->body = loop;
+    }
+    if (trip < 0 || trip % unroll_factor)
+        loop->next = node;
+    return block;
+}
+
+static void unroll_stmts(Node **p) {
+    for (; *p; p = &(*p)->next) {
+        Node *node = *p;
+        switch (node->kind) {
+            case ND_IF:
+                unroll_stmts(&node->then);
+                unroll_stmts(&node->els);
+                break;
+            case ND_WHILE:
+            case ND_SWITCH:
+            case ND_CASE:
+                unroll_stmts(&node->then);
+                break;
+            case ND_FOR: {
+                unroll_stmts(&node->then);
+                Node *next = node->next;
+                node->next = NULL;
+                Node *block = unroll(node);
+                if (block) {
+                    num_unrolled++;
+                    block->next = next;
+                    *p = block;
+                } else {
+                    node->next = next;
+                }
+                break;
+            }
+            case ND_BLOCK:
+                unroll_stmts(&node->body);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// 展開したループの数を返す
+int unroll_loops(Program *prog) {
+    num_unrolled = 0;
+    if (unroll_factor <= 1)
+        return 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+        unroll_stmts(&fn->node);
+    return num_unrolled;
+}
@@ -0,0 +1,158 @@
+#include "9cc.h"
+
+// 単純な配列のループの SSE2 によるベクトル化 (--vectorize)。
+//
+//   for (i = ...; i < n; i = i + 1) a[i] = b[i] + c[i];   (- も可)
+//   for (i = ...; i < n; i = i + 1) a[i] = b[i];
+//   for (i = ...; i < n; i = i + 1) s = s + a[i];
+//
+// の形の for ループに VecLoop を付ける。要素は int か char で、
+// 総和は int だけ。codegen は init の後に 16 バイトずつ進むループを出し、
+// 残りは元のループがそのまま処理する。
+//
+// i, n, s はアドレスを取られないローカル変数 (n は定数でもよい) に、
+// 配列は配列の変数かローカルのポインタ変数に限る。
+
+static _Thread_local int num_vectorized;
+
+static bool is_scalar_local(Node *node) {
+    return node->kind == ND_VAR && node->var->is_local &&
+        !node->var->addr_taken && node->var->ty->kind == TY_INT;
+}
+
+// X[i] なら X の VAR ノードを返す
+static Node *element(Node *node, Var *i) {
+    if (node->kind != ND_DEREF)
+        return NULL;
+    Node *addr = node->lhs;
+    if (addr->kind != ND_PTR_ADD || addr->rhs->kind != ND_VAR ||
+            addr->rhs->var != i || addr->lhs->kind != ND_VAR)
+        return NULL;
+
+    Var *base = addr->lhs->var;
+    if (base->ty->kind != TY_ARRAY &&
+            !(base->ty->kind == TY_PTR && base->is_local && !base->addr_taken))
+        return NULL;
+    if (node->ty->kind != TY_INT && node->ty->kind != TY_CHAR)
+        return NULL;
+    return addr->lhs;
+}
+
+// i = i + 1
+static bool is_increment(Node *inc, Var *i) {
+    if (!inc || inc->lhs->kind != ND_ASSIGN)
+        return false;
+    Node *assign = inc->lhs;
+    Node *add = assign->rhs;
+    return assign->lhs->kind == ND_VAR && assign->lhs->var == i &&
+        add->kind == ND_ADD && add->lhs->kind == ND_VAR && add->lhs->var == i &&
+        add->rhs->kind == ND_NUM && add->rhs->val == 1;
+}
+
+static bool match_body(VecLoop *v, Node *assign) {
+    Var *i = v->i->var;
+    Node *lhs = assign->lhs;
+    Node *rhs = assign->rhs;
+
+    // s = s + a[i] か s = a[i] + s
+    if (is_scalar_local(lhs)) {
+        if (lhs->var == i || (v->end->kind == ND_VAR && lhs->var == v->end->var))
+            return false;
+        if (rhs->kind != ND_ADD)
+            return false;
+        Node *elem = rhs->rhs;
+        if (rhs->lhs->kind != ND_VAR || rhs->lhs->var != lhs->var) {
+            elem = rhs->lhs;
+            if (rhs->rhs->kind != ND_VAR || rhs->rhs->var != lhs->var)
+                return false;
+        }
+        v->src[0] = element(elem, i);
+        if (!v->src[0] || elem->ty->kind != TY_INT)
+            return false;
+        v->acc = lhs;
+        v->size = 8;
+        return true;
+    }
+
+    // a[i] = b[i] op c[i] か a[i] = b[i]
+    v->dst = element(lhs, i);
+    if (!v->dst)
+        return false;
+    v->size = lhs->ty->size;
+
+    Node *srcs[2] = {rhs, NULL};
+    if (rhs->kind == ND_ADD || rhs->kind == ND_SUB) {
+        v->op = rhs->kind;
+        srcs[0] = rhs->lhs;
+        srcs[1] = rhs->rhs;
+    }
+    for (int k = 0; k < 2 && srcs[k]; k++) {
+        v->src[k] = element(srcs[k], i);
+        if (!v->src[k] || srcs[k]->ty->size != v->size)
+            return false;
+    }
+    return true;
+}
+
+static VecLoop *match(Node *node) {
+    Node *cond = node->cond;
+    if (!cond || (cond->kind != ND_LT && cond->kind != ND_LE) ||
+            !is_scalar_local(cond->lhs))
+        return NULL;
+    Node *end = cond->rhs;
+    if (end->kind != ND_NUM &&
+            (!is_scalar_local(end) || end->var == cond->lhs->var))
+        return NULL;
+    if (!is_increment(node->inc, cond->lhs->var))
+        return NULL;
+
+    Node *body = node->then;
+    if (body->kind == ND_BLOCK && body->body && !body->body->next)
+        body = body->body;
+    if (body->kind != ND_EXPR_STMT || body->lhs->kind != ND_ASSIGN)
+        return NULL;
+
+    VecLoop *v = arena_alloc(sizeof(VecLoop));
+    v->i = cond->lhs;
+    v->end = end;
+    v->inclusive = cond->kind == ND_LE;
+    if (!match_body(v, body->lhs))
+        return NULL;
+    return v;
+}
+
+static void vectorize_stmts(Node *node) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+            case ND_IF:
+                vectorize_stmts(node->then);
+                vectorize_stmts(node->els);
+                break;
+            case ND_WHILE:
+            case ND_SWITCH:
+            case ND_CASE:
+                vectorize_stmts(node->then);
+                break;
+            case ND_FOR:
+                node->vec = match(node);
+                if (node->vec)
+                    num_vectorized++;
+                else
+                    vectorize_stmts(node->then);
+                break;
+            case ND_BLOCK:
+                vectorize_stmts(node->body);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// ベクトル化したループの数を返す
+int vectorize_loops(Program *prog) {
+    num_vectorized = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+        vectorize_stmts(fn->node);
+    return num_vectorized;
+}